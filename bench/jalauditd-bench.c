@@ -0,0 +1,660 @@
+/**
+ * @file jalauditd-bench.c This file contains a benchmark driver for
+ * jalauditd. It replays a captured audit.log (or generates synthetic
+ * SYSCALL/EXECVE/CWD/PATH/PROCTITLE events) into the plugin's stdin at a
+ * controlled rate and acts as a stub JALoP local store, reporting
+ * throughput, missing records, records in flight over time and end to end
+ * latency percentiles.
+ *
+ * @section LICENSE
+ *
+ * All source code is copyright Tresys Technology and licensed as below.
+ *
+ * Copyright (c) 2011 Tresys Technology LLC, Columbia, Maryland, USA
+ *
+ * This software was developed by Tresys Technology LLC
+ * with U.S. Government sponsorship.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+
+#define UNUSED(x) (void)(x)
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+
+/*
+ * Framing used by the JALoP producer library on the local store socket:
+ * protocol version and message type (16 bits each), data and metadata
+ * lengths (64 bits each), the data, "BREAK", the metadata and "BREAK".
+ */
+#define JALP_PROTOCOL_VERSION 1
+#define JALP_BREAK_STR "BREAK"
+#define JALP_BREAK_LEN 5
+#define JALP_HEADER_LEN (2 + 2 + 8 + 8)
+
+/*
+ * Send times of recent events, indexed by the audit serial number the
+ * driver assigned to them. The store side looks up the serial found in
+ * each record's metadata to compute end to end latency.
+ */
+#define SEND_TABLE_SIZE (1 << 20)
+
+struct send_slot {
+	unsigned long serial;
+	long long sent_ns;
+};
+
+static struct send_slot *send_table = NULL;
+
+static unsigned long records_written = 0;
+static unsigned long events_written = 0;
+static unsigned long records_stored = 0;
+static unsigned long bytes_stored = 0;
+
+static uint32_t *latencies = NULL;
+static size_t latencies_len = 0;
+static size_t latencies_cap = 0;
+static pthread_mutex_t latencies_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int listen_fd = -1;
+static int stop_store = 0;
+
+static long long now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-j jalauditd] [-c config] [-f audit.log] [-n events]\n"
+		"          [-r events/s] [-p paths] [-t drain seconds]\n"
+		"\n"
+		"  -j  jalauditd binary to run (default ./jalauditd)\n"
+		"  -c  jalauditd config to append to the generated one\n"
+		"  -f  replay this audit.log instead of synthetic events\n"
+		"  -n  number of synthetic events (default 100000)\n"
+		"  -r  input rate in events per second, 0 for unlimited\n"
+		"  -p  PATH records per synthetic event (default 2)\n"
+		"  -t  seconds to wait for the plugin to drain (default 5)\n",
+		prog);
+}
+
+static void latency_add(uint32_t usec)
+{
+	uint32_t *grown;
+
+	pthread_mutex_lock(&latencies_mutex);
+	if (latencies_len == latencies_cap) {
+		latencies_cap = latencies_cap ? latencies_cap * 2 : 65536;
+		grown = realloc(latencies, latencies_cap * sizeof(*latencies));
+		if (!grown) {
+			pthread_mutex_unlock(&latencies_mutex);
+			return;
+		}
+		latencies = grown;
+	}
+	latencies[latencies_len++] = usec;
+	pthread_mutex_unlock(&latencies_mutex);
+}
+
+static void record_sent(unsigned long serial)
+{
+	struct send_slot *slot = &send_table[serial % SEND_TABLE_SIZE];
+
+	__atomic_store_n(&slot->sent_ns, now_ns(), __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->serial, serial, __ATOMIC_RELEASE);
+}
+
+/* Find "audit(sec.milli:serial)" in a stored record and time it. */
+static void record_stored(const char *meta, size_t len)
+{
+	const char *pos;
+	const char *end = meta + len;
+	struct send_slot *slot;
+	unsigned long serial;
+	long long sent;
+	char buf[64];
+	size_t n;
+
+	pos = memmem(meta, len, "audit(", 6);
+	if (!pos) {
+		return;
+	}
+	pos += 6;
+	n = MIN((size_t)(end - pos), sizeof(buf) - 1);
+	memcpy(buf, pos, n);
+	buf[n] = '\0';
+	pos = strchr(buf, ':');
+	if (!pos) {
+		return;
+	}
+	serial = strtoul(pos + 1, NULL, 10);
+	slot = &send_table[serial % SEND_TABLE_SIZE];
+	if (__atomic_load_n(&slot->serial, __ATOMIC_ACQUIRE) != serial) {
+		return;
+	}
+	sent = __atomic_load_n(&slot->sent_ns, __ATOMIC_RELAXED);
+	latency_add((uint32_t)MIN((now_ns() - sent) / 1000, (long long)UINT32_MAX));
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+	char *pos = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(fd, pos, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		pos += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* One connection from the plugin, i.e. one sender thread's context. */
+static void *store_connection(void *ptr)
+{
+	int fd = (int)(long)ptr;
+	uint8_t header[JALP_HEADER_LEN];
+	uint16_t version;
+	uint64_t data_len;
+	uint64_t meta_len;
+	char brk[JALP_BREAK_LEN];
+	char *buf = NULL;
+	size_t buf_len = 0;
+	char *grown;
+
+	for (;;) {
+		if (read_full(fd, header, sizeof(header)) < 0) {
+			break;
+		}
+		memcpy(&version, header, sizeof(version));
+		memcpy(&data_len, header + 4, sizeof(data_len));
+		memcpy(&meta_len, header + 12, sizeof(meta_len));
+		if (version != JALP_PROTOCOL_VERSION) {
+			fprintf(stderr, "unexpected JALoP protocol version %u\n", version);
+			break;
+		}
+		if (data_len + meta_len > buf_len) {
+			grown = realloc(buf, data_len + meta_len);
+			if (!grown) {
+				break;
+			}
+			buf = grown;
+			buf_len = data_len + meta_len;
+		}
+		if (read_full(fd, buf, data_len) < 0
+				|| read_full(fd, brk, sizeof(brk)) < 0
+				|| memcmp(brk, JALP_BREAK_STR, JALP_BREAK_LEN) != 0
+				|| read_full(fd, buf + data_len, meta_len) < 0
+				|| read_full(fd, brk, sizeof(brk)) < 0
+				|| memcmp(brk, JALP_BREAK_STR, JALP_BREAK_LEN) != 0) {
+			fprintf(stderr, "malformed JALoP message\n");
+			break;
+		}
+		record_stored(buf + data_len, meta_len);
+		__atomic_add_fetch(&bytes_stored, data_len + meta_len, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&records_stored, 1, __ATOMIC_RELAXED);
+	}
+	free(buf);
+	close(fd);
+	return NULL;
+}
+
+static void *store_accept(void *ptr)
+{
+	pthread_t thread;
+	struct pollfd pfd;
+	int fd;
+
+	UNUSED(ptr);
+	pfd.fd = listen_fd;
+	pfd.events = POLLIN;
+	while (!__atomic_load_n(&stop_store, __ATOMIC_RELAXED)) {
+		if (poll(&pfd, 1, 100) <= 0) {
+			continue;
+		}
+		fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			continue;
+		}
+		if (pthread_create(&thread, NULL, store_connection, (void *)(long)fd) != 0) {
+			close(fd);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	return NULL;
+}
+
+static int store_listen(const char *path)
+{
+	struct sockaddr_un addr;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0) {
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, path, strlen(path) + 1);
+	unlink(path);
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+			|| listen(listen_fd, 64) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+static int write_full(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Sleep until the given number of events is due at the requested rate. */
+static void pace(long long start, unsigned long events, long rate)
+{
+	long long due;
+	long long now;
+	struct timespec ts;
+
+	if (rate <= 0) {
+		return;
+	}
+	due = start + (long long)(events * (1000000000.0 / rate));
+	now = now_ns();
+	if (due > now) {
+		ts.tv_sec = (due - now) / 1000000000LL;
+		ts.tv_nsec = (due - now) % 1000000000LL;
+		nanosleep(&ts, NULL);
+	}
+}
+
+static int generate_event(int fd, unsigned long serial, int paths)
+{
+	char buf[8192];
+	char stamp[64];
+	struct timespec now;
+	int len = 0;
+	int i;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	snprintf(stamp, sizeof(stamp), "audit(%ld.%03ld:%lu)", (long)now.tv_sec,
+			now.tv_nsec / 1000000, serial);
+
+	len += snprintf(buf + len, sizeof(buf) - len,
+		"type=SYSCALL msg=%s: arch=c000003e syscall=59 success=yes exit=0 "
+		"a0=55d0c4b6a2f0 a1=55d0c4b6a390 a2=55d0c4b69e00 a3=8 items=%d "
+		"ppid=%lu pid=%lu auid=1000 uid=1000 gid=1000 euid=1000 suid=1000 "
+		"fsuid=1000 egid=1000 sgid=1000 fsgid=1000 tty=pts0 ses=3 "
+		"comm=\"cc1\" exe=\"/usr/libexec/gcc/x86_64-linux-gnu/12/cc1\" "
+		"key=\"exec\"\n", stamp, paths, 1000 + serial % 30000,
+		2000 + serial % 30000);
+	len += snprintf(buf + len, sizeof(buf) - len,
+		"type=EXECVE msg=%s: argc=6 a0=\"cc1\" a1=\"-quiet\" a2=\"-O2\" "
+		"a3=\"-I/usr/include/glib-2.0\" a4=\"bench_%lu.c\" a5=\"-o\"\n",
+		stamp, serial);
+	len += snprintf(buf + len, sizeof(buf) - len,
+		"type=CWD msg=%s: cwd=\"/home/builder/src/project\"\n", stamp);
+	for (i = 0; i < paths; i++) {
+		len += snprintf(buf + len, sizeof(buf) - len,
+			"type=PATH msg=%s: item=%d name=\"/usr/bin/cc%d\" inode=%lu "
+			"dev=fd:00 mode=0100755 ouid=0 ogid=0 rdev=00:00 "
+			"nametype=NORMAL cap_fp=0 cap_fi=0 cap_fe=0 cap_fver=0\n",
+			stamp, i, i, 131000 + serial % 1000);
+	}
+	len += snprintf(buf + len, sizeof(buf) - len,
+		"type=PROCTITLE msg=%s: proctitle=6363310071756965740"
+		"02D4F32006263656E63682E63\n", stamp);
+	len += snprintf(buf + len, sizeof(buf) - len, "type=EOE msg=%s: \n", stamp);
+
+	record_sent(serial);
+	__atomic_add_fetch(&records_written, 4 + paths, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&events_written, 1, __ATOMIC_RELAXED);
+	return write_full(fd, buf, len);
+}
+
+/*
+ * Replay a captured log. Each record's audit(...) stamp is rewritten with
+ * the current time and a fresh serial, keeping consecutive records of one
+ * event together, so that events age and time the same way live ones do.
+ */
+static int replay_log(int fd, const char *path, long rate)
+{
+	FILE *log;
+	char line[16384];
+	char out[16500];
+	char last_stamp[128] = "";
+	char *start;
+	char *end;
+	unsigned long serial = 0;
+	long long begin = now_ns();
+	struct timespec now;
+	int len;
+	int rc = 0;
+
+	log = fopen(path, "r");
+	if (!log) {
+		fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	while (fgets(line, sizeof(line), log)) {
+		start = strstr(line, "audit(");
+		end = start ? strchr(start, ')') : NULL;
+		if (!start || !end || (size_t)(end - start) >= sizeof(last_stamp)) {
+			continue;
+		}
+		if (strncmp(start, last_stamp, end - start) != 0
+				|| last_stamp[end - start] != '\0') {
+			memcpy(last_stamp, start, end - start);
+			last_stamp[end - start] = '\0';
+			pace(begin, serial, rate);
+			serial++;
+			record_sent(serial);
+			__atomic_add_fetch(&events_written, 1, __ATOMIC_RELAXED);
+		}
+		clock_gettime(CLOCK_REALTIME, &now);
+		len = snprintf(out, sizeof(out), "%.*saudit(%ld.%03ld:%lu%s",
+				(int)(start - line), line, (long)now.tv_sec,
+				now.tv_nsec / 1000000, serial, end);
+		if (len >= (int)sizeof(out)) {
+			continue;
+		}
+		if (write_full(fd, out, len) < 0) {
+			rc = -1;
+			break;
+		}
+		__atomic_add_fetch(&records_written, 1, __ATOMIC_RELAXED);
+	}
+	fclose(log);
+	return rc;
+}
+
+static int write_config(const char *path, const char *sock, const char *base)
+{
+	FILE *out;
+	FILE *in;
+	char line[4096];
+
+	out = fopen(path, "w");
+	if (!out) {
+		return -1;
+	}
+	fprintf(out, "socket = \"%s\";\n", sock);
+	if (base) {
+		in = fopen(base, "r");
+		if (!in) {
+			fclose(out);
+			return -1;
+		}
+		while (fgets(line, sizeof(line), in)) {
+			// The bench always supplies its own socket
+			if (strncmp(line, "socket", 6) != 0) {
+				fputs(line, out);
+			}
+		}
+		fclose(in);
+	}
+	fclose(out);
+	return 0;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static uint32_t percentile(double p)
+{
+	size_t i;
+
+	if (latencies_len == 0) {
+		return 0;
+	}
+	i = (size_t)(p / 100.0 * (latencies_len - 1));
+	return latencies[i];
+}
+
+struct driver_args {
+	int fd;
+	const char *log;
+	unsigned long events;
+	long rate;
+	int paths;
+	int done;
+};
+
+static void *driver(void *ptr)
+{
+	struct driver_args *args = ptr;
+	long long begin = now_ns();
+	unsigned long i;
+
+	if (args->log) {
+		replay_log(args->fd, args->log, args->rate);
+	} else {
+		for (i = 1; i <= args->events; i++) {
+			pace(begin, i - 1, args->rate);
+			if (generate_event(args->fd, i, args->paths) < 0) {
+				break;
+			}
+		}
+	}
+	__atomic_store_n(&args->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	const char *jalauditd = "./jalauditd";
+	const char *base_config = NULL;
+	struct driver_args args;
+	char dir[] = "/tmp/jalauditd-bench.XXXXXX";
+	char sock[256];
+	char conf[256];
+	pthread_t accept_thread;
+	pthread_t driver_thread;
+	int pipe_fds[2];
+	int drain = 5;
+	int opt;
+	int wstatus;
+	pid_t child;
+	long long begin;
+	long long end;
+	long long idle_since;
+	unsigned long last_stored = 0;
+	unsigned long stored;
+	unsigned long written;
+	double elapsed;
+	int second = 0;
+
+	memset(&args, 0, sizeof(args));
+	args.events = 100000;
+	args.paths = 2;
+
+	while ((opt = getopt(argc, argv, "j:c:f:n:r:p:t:h")) != -1) {
+		switch (opt) {
+		case 'j':
+			jalauditd = optarg;
+			break;
+		case 'c':
+			base_config = optarg;
+			break;
+		case 'f':
+			args.log = optarg;
+			break;
+		case 'n':
+			args.events = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			args.rate = strtol(optarg, NULL, 10);
+			break;
+		case 'p':
+			args.paths = atoi(optarg);
+			break;
+		case 't':
+			drain = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	send_table = calloc(SEND_TABLE_SIZE, sizeof(*send_table));
+	if (!send_table || !mkdtemp(dir)) {
+		fprintf(stderr, "failure setting up benchmark\n");
+		return 1;
+	}
+	snprintf(sock, sizeof(sock), "%s/jalop.sock", dir);
+	snprintf(conf, sizeof(conf), "%s/jalauditd.conf", dir);
+
+	if (store_listen(sock) < 0 || write_config(conf, sock, base_config) < 0) {
+		fprintf(stderr, "failure creating stub local store in %s: %s\n", dir,
+				strerror(errno));
+		return 1;
+	}
+	pthread_create(&accept_thread, NULL, store_accept, NULL);
+
+	if (pipe(pipe_fds) < 0) {
+		perror("pipe");
+		return 1;
+	}
+	child = fork();
+	if (child < 0) {
+		perror("fork");
+		return 1;
+	}
+	if (child == 0) {
+		dup2(pipe_fds[0], 0);
+		close(pipe_fds[0]);
+		close(pipe_fds[1]);
+		execl(jalauditd, jalauditd, "-c", conf, (char *)NULL);
+		perror(jalauditd);
+		_exit(127);
+	}
+	close(pipe_fds[0]);
+
+	args.fd = pipe_fds[1];
+	begin = now_ns();
+	pthread_create(&driver_thread, NULL, driver, &args);
+
+	// Sample records in flight (written but not yet stored) once a second
+	// until the input is done and the store has gone quiet.
+	printf("%6s %12s %12s %10s\n", "second", "written", "stored", "in-flight");
+	idle_since = 0;
+	for (;;) {
+		sleep(1);
+		second++;
+		written = __atomic_load_n(&records_written, __ATOMIC_RELAXED);
+		stored = __atomic_load_n(&records_stored, __ATOMIC_RELAXED);
+		printf("%6d %12lu %12lu %10ld\n", second, written, stored,
+				(long)(written - stored));
+		if (!__atomic_load_n(&args.done, __ATOMIC_ACQUIRE)) {
+			continue;
+		}
+		if (stored != last_stored || !idle_since) {
+			idle_since = now_ns();
+		} else if (stored >= written
+				|| now_ns() - idle_since >= (long long)drain * 1000000000LL) {
+			break;
+		}
+		last_stored = stored;
+		if (waitpid(child, &wstatus, WNOHANG) == child) {
+			child = -1;
+			break;
+		}
+	}
+	end = now_ns();
+
+	pthread_join(driver_thread, NULL);
+	close(pipe_fds[1]);
+	if (child > 0) {
+		kill(child, SIGTERM);
+		waitpid(child, &wstatus, 0);
+	}
+	__atomic_store_n(&stop_store, 1, __ATOMIC_RELAXED);
+	pthread_join(accept_thread, NULL);
+
+	written = __atomic_load_n(&records_written, __ATOMIC_RELAXED);
+	stored = __atomic_load_n(&records_stored, __ATOMIC_RELAXED);
+	elapsed = (end - begin) / 1e9;
+
+	pthread_mutex_lock(&latencies_mutex);
+	qsort(latencies, latencies_len, sizeof(*latencies), compare_u32);
+	printf("\n");
+	printf("events written:     %lu\n", events_written);
+	printf("records written:    %lu\n", written);
+	printf("records stored:     %lu (%.0f records/s, %.1f MiB/s)\n", stored,
+			stored / elapsed, bytes_stored / elapsed / (1024 * 1024));
+	printf("records missing:    %ld\n", (long)(written - stored));
+	printf("latency samples:    %zu\n", latencies_len);
+	printf("latency p50/p90/p99/p99.9/max (us): %u %u %u %u %u\n",
+			percentile(50), percentile(90), percentile(99),
+			percentile(99.9), percentile(100));
+	pthread_mutex_unlock(&latencies_mutex);
+	printf("\nWith aggregate = \"event\" or filters configured, stored records\n"
+	       "are not expected to match written records one to one.\n");
+
+	unlink(sock);
+	unlink(conf);
+	rmdir(dir);
+	return 0;
+}
@@ -26,8 +26,10 @@
 
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <signal.h>
 #include <libconfig.h>
 #include <unistd.h>
@@ -40,6 +42,24 @@
 #include <pthread.h>
 #include <errno.h>
 #include <time.h>
+#include <poll.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <sched.h>
+#include <dirent.h>
+#include <zlib.h>
+#include <linux/netlink.h>
 
 #include <jalop/jalp_context.h>
 #include <jalop/jalp_audit.h>
@@ -58,299 +78,6264 @@
 #define PRINTSTATS "printstats"
 #define PRINTSTATSFREQ "printstatsfreq"
 #define QUEUEMAXLENGTH "queuemaxlength"
+#define QUEUEMAXBYTES "queue_max_bytes"
+#define QUEUEHIGHWATERMARK "queue_high_watermark"
+#define QUEUELOWWATERMARK "queue_low_watermark"
+#define SHEDTYPES "shed_types"
+#define HIGHPRIORITYTYPES "high_priority_types"
+#define LOWPRIORITYTYPES "low_priority_types"
+#define HIGHPRIORITYWEIGHT "high_priority_weight"
+#define NORMALPRIORITYWEIGHT "normal_priority_weight"
+#define LOWPRIORITYWEIGHT "low_priority_weight"
+#define SENDERTHREADS "sender_threads"
+#define BATCHMAXRECORDS "batch_max_records"
+#define BATCHMAXDELAYMS "batch_max_delay_ms"
+#define PAYLOAD "payload"
+#define AGGREGATE "aggregate"
+#define CONVERT "convert"
+#define INCLUDETYPES "include_types"
+#define EXCLUDETYPES "exclude_types"
+#define EXCLUDEKEYS "exclude_keys"
+#define EXCLUDEFIELDS "exclude_fields"
+#define STATSSOCKET "stats_socket"
+#define STATSLISTEN "stats_listen"
+#define SPOOLDIR "spool_dir"
+#define SPOOLSEGMENTSIZE "spool_segment_size"
+#define SPOOLMAXSEGMENTS "spool_max_segments"
+#define DRAINTIMEOUT "drain_timeout"
+#define AGINGPERIODMS "aging_period_ms"
+#define INPUT "input"
+#define PARSERTHREADS "parser_threads"
+#define COALESCEFIELDS "coalesce_fields"
+#define COALESCEWINDOWMS "coalesce_window_ms"
+#define COALESCEMAXENTRIES "coalesce_max_entries"
+#define RATELIMIT "rate_limit"
+#define RATELIMITBURST "rate_limit_burst"
+#define RATELIMITFIELDS "rate_limit_fields"
+#define RATELIMITMAXSOURCES "rate_limit_max_sources"
+#define OVERLOADPOLICY "overload_policy"
+#define OVERLOADTIMEOUT "overload_timeout"
+#define RECONNECTMINMS "reconnect_min_ms"
+#define RECONNECTMAXMS "reconnect_max_ms"
+#define INTERPRETFIELDS "interpret_fields"
 
-#define QUEUE_FULL_TIMEOUT 5
-
+/*
+ * Main loop state. SIGHUP and SIGTERM arrive through signal_fd and
+ * senders ask for a reload through wake_fd, so status only changes via
+ * status_request() and a pending STOP is never overwritten.
+ */
 #define RUN	0
 #define STOP	1
 #define RELOAD	2
 static int status = RUN;
+static int wake_fd = -1;
+
+/*
+ * Input of the main loop: stdin, signal_fd, wake_fd and timer_fd are
+ * waited on with one epoll instance, and stdin is read INPUT_BUFFER_SIZE
+ * bytes at a time so that a busy audit stream costs two system calls per
+ * buffer rather than per record. timer_fd fires every aging_period_ms
+ * while auparse holds incomplete events, whether or not input keeps
+ * arriving, so the last event of a burst is never held for long.
+ */
+#define INPUT_BUFFER_SIZE (256 * 1024)
+#define INPUT_READABLE 1
+#define INPUT_AGING 2
+static int epoll_fd = -1;
+static int signal_fd = -1;
+static int timer_fd = -1;
+static int input_fd = 0;
+static int stdin_polled = 1;
+static int aging_period_ms = 1000;
+static int aging_armed_ms = 0;
+static char input_buffer[INPUT_BUFFER_SIZE];
+
+/*
+ * With input = "netlink", records are taken from the kernel's read-only
+ * audit multicast group rather than from audispd on stdin. That skips
+ * the trip through auditd and audispd; the kernel's record text goes to
+ * auparse as it is, behind the "type=NAME msg=" prefix auditd would add.
+ * Up to NETLINK_BATCH messages are received per recvmmsg() call. The
+ * group is best effort: the kernel drops messages, counted as overruns,
+ * if the socket buffer fills.
+ */
+#define INPUT_STDIN 0
+#define INPUT_NETLINK 1
+#define NETLINK_BATCH 64
+#define NETLINK_MSG_SIZE NLMSG_SPACE(MAX_AUDIT_MESSAGE_LENGTH)
+#define NETLINK_RCVBUF (8 * 1024 * 1024)
+#ifndef AUDIT_NLGRP_READLOG
+#define AUDIT_NLGRP_READLOG 1
+#endif
+static int input_mode = INPUT_STDIN;
+static int input_source = INPUT_STDIN;
+static char (*netlink_buffers)[NETLINK_MSG_SIZE] = NULL;
+
+/*
+ * With -r, the audit.log files named on the command line are replayed
+ * instead of a live stream, and jalauditd exits once everything read
+ * has been sent. Plain files are mapped and gzip compressed ones are
+ * inflated, and either is fed REPLAY_SEGMENT_SIZE bytes at a time, cut
+ * at a line boundary. Every record and parser chunk holds on to the
+ * segment it came from, so the checkpoint written every
+ * REPLAY_CHECKPOINT_MS with -k can name a position before which
+ * everything has been sent. A replay resumes one segment before the
+ * first one still in flight, since auparse completes the last events of
+ * a segment while parsing the next: an interrupted replay repeats up to
+ * a segment of events, but loses none. Nothing is shed, coalesced, rate
+ * limited or dropped for space, as overload_policy would for a live
+ * stream; the replay waits for the senders instead.
+ */
+#define INPUT_REPLAY 2
+#define REPLAY_SEGMENT_SIZE (4 * 1024 * 1024)
+#define REPLAY_CHECKPOINT_MS 1000
+#define REPLAY_LINE_MAX (PATH_MAX + 128)
+
+struct replay_file {
+	const char *path;
+	dev_t dev;
+	ino_t ino;
+	off_t offset;
+	int done;
+};
+
+struct replay_segment {
+	struct replay_segment *next;
+	int file;
+	off_t start;
+	int fed;
+	int lost;
+	int outstanding;
+};
+
+static int replay = 0;
+static const char *replay_checkpoint_path = NULL;
+static struct replay_file *replay_files = NULL;
+static int replay_count = 0;
+static int replay_index = 0;
+static int replay_reading = 0;
+static int replay_finished = 0;
+static int replay_fd = -1;
+static char *replay_map = NULL;
+static size_t replay_map_len = 0;
+static gzFile replay_gz = NULL;
+static char *replay_buffer = NULL;
+static size_t replay_used = 0;
+static size_t replay_carry = 0;
+static off_t replay_pos = 0;
+static struct replay_segment *replay_head = NULL;
+static struct replay_segment *replay_tail = NULL;
+static __thread struct replay_segment *replay_current = NULL;
+static long long replay_saved_ms = 0;
+static int replay_save_failed = 0;
+
+static const char *config_path = CONFIG_PATH;
+
+#define CACHE_LINE_SIZE 64
+#define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE_SIZE)))
+
+/*
+ * Bounded multi-producer/multi-consumer ring buffer (after Dmitry Vyukov's
+ * design). Every cell carries a sequence number that tells producers and
+ * consumers whose turn it is, so push and pop need only a single CAS on
+ * the shared position and never allocate. Threads that find the ring
+ * empty (or full) sleep on an eventfd, which is only written when someone
+ * is actually waiting on it. ring_interrupt() makes blocked consumers
+ * return empty-handed, so senders can be stopped without cancelling them.
+ */
+struct ring_cell {
+	unsigned long seq;
+	void *data;
+};
+
+struct ring {
+	unsigned long enqueue_pos CACHE_ALIGNED;
+	unsigned long dequeue_pos CACHE_ALIGNED;
+	int data_waiters CACHE_ALIGNED;
+	int space_waiters CACHE_ALIGNED;
+	int data_fd CACHE_ALIGNED;
+	int space_fd;
+	int interrupted;
+	unsigned long capacity;
+	struct ring_cell *cells;
+};
+
+/*
+ * The event queue is made of one ring per priority lane, each holding up
+ * to queuemaxlength records. Senders sleep on the normal lane; pushes to
+ * the other lanes wake them through it, as spool appends do.
+ */
+#define LANE_HIGH 0
+#define LANE_NORMAL 1
+#define LANE_LOW 2
+#define LANE_COUNT 3
+
+static struct ring *event_lanes[LANE_COUNT];
+static const char *const lane_names[LANE_COUNT] = { "high", "normal", "low" };
+
+/*
+ * With parser_threads above 1, the main thread only splits its input
+ * into lines and hands each line, by the serial number of its event, to
+ * one of that many parsers, each with an auparse state of its own. All
+ * records of an event reach the same parser in input order, and an
+ * event is converted and queued by that parser alone, so the order of
+ * records within an event is kept; distinct events are queued in no
+ * particular order, as the senders send them in no particular order.
+ * Lines travel in chunks of up to PARSE_CHUNK_SIZE bytes, recycled
+ * through chunk_pool. Parsers hold parse_lock for reading while they
+ * work, which lets a reload replace filters and queue under the write
+ * lock.
+ */
+#define PARSE_CHUNK_SIZE (64 * 1024)
+#define PARSE_QUEUE_LENGTH 4
+#define PARSE_POOL_SIZE 256
+
+struct parse_chunk {
+	struct replay_segment *segment;
+	size_t len;
+	char data[PARSE_CHUNK_SIZE];
+};
+
+/* The tables of a thread that parses, the auparse callback's user_data. */
+struct event_tables {
+	struct coalescer *coalescer;
+	struct limiter *limiter;
+};
+
+struct parser {
+	pthread_t thread;
+	auparse_state_t *au;
+	struct event_tables tables;
+	struct ring *chunks;
+	struct parse_chunk *pending;
+};
+
+static int parser_threads = 1;
+static int num_parsers = 0;
+static struct parser *parsers = NULL;
+static struct ring *chunk_pool = NULL;
+static pthread_rwlock_t parse_lock;
+static char split_line[PARSE_CHUNK_SIZE];
+static size_t split_line_len = 0;
+static int split_discard = 0;
+
+/*
+ * Every queued record keeps its JALoP structures, parameter nodes and
+ * strings in a small arena that starts inside the record allocation
+ * itself and grows in ARENA_BLOCK_SIZE pieces for oversized records.
+ * Releasing a record frees any overflow blocks and returns the record to
+ * record_pool, so steady-state parsing does not touch malloc at all.
+ *
+ * Until a sender unpacks it, a packed record (see convert) only holds
+ * its message there, followed at packed_index by a packed_field per
+ * parameter of each structured data element, preceded by their count.
+ * The offsets of a packed_field point at the key and value right in the
+ * message, so a record's bytes are stored once; only fields that do not
+ * appear verbatim are copied, after the index. C strings are made from
+ * them when the record is sent or spooled.
+ */
+#define RECORD_BLOCK_SIZE 2048
+#define ARENA_BLOCK_SIZE 2048
+#define ARENA_ALIGN sizeof(void *)
+#define RECORD_POOL_SIZE 1024
+#define PACKED_ALIGN(len) (((len) + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1))
+#define PACKED_KEY_MAX 64
+
+struct packed_field {
+	uint32_t key;
+	uint32_t value;
+	uint16_t key_len;
+	uint16_t value_len;
+};
+
+struct arena_block {
+	struct arena_block *next;
+	char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+struct audit_record {
+	struct jalp_app_metadata app;
+	struct jalp_logger_metadata log;
+	struct jalp_structured_data sd;
+	struct arena_block *extra;
+	char *cur;
+	char *end;
+	size_t bytes;
+	char *packed;
+	size_t packed_index;
+	uint32_t packed_nsd;
+	struct audit_record *next;
+	struct replay_segment *segment;
+	int lane;
+	long long enqueued_ns;
+	char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
 
-GQueue* event_queue = NULL; 
-pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t data_in_queue = PTHREAD_COND_INITIALIZER;
-pthread_cond_t queue_full = PTHREAD_COND_INITIALIZER;
+static struct ring *record_pool = NULL;
+
+/*
+ * Strings shared by every record. Records are released through the arena
+ * rather than jalp_app_metadata_destroy(), so these are never freed.
+ */
+#define LOGGER_NAME "auditd"
+#define SD_ID "audit"
+
+/*
+ * Field names emitted by the kernel and user space auditing tools. Keys in
+ * this set are looked up in interned_keys and referenced rather than
+ * copied into each record's arena. The table is filled once at startup
+ * and only read afterwards, so lookups need no locking.
+ */
+static const char *const field_names[] = {
+	"type", "arch", "syscall", "success", "exit", "a0", "a1", "a2", "a3",
+	"a4", "a5", "a6", "a7", "a8", "a9", "argc", "items", "ppid", "pid",
+	"auid", "uid", "gid", "euid", "suid", "fsuid", "egid", "sgid",
+	"fsgid", "tty", "ses", "comm", "exe", "subj", "key", "cwd", "item",
+	"name", "inode", "dev", "mode", "ouid", "ogid", "rdev", "obj",
+	"nametype", "cap_fp", "cap_fi", "cap_fe", "cap_fver", "cap_frootid",
+	"cap_pi", "cap_pp", "cap_pe", "cap_pa", "cap_pnt", "cap_bnd",
+	"old_pp", "old_pi", "old_pe", "old_pa", "pe", "pi", "pp", "pa",
+	"proctitle", "msg", "op", "acct", "hostname", "addr", "terminal",
+	"res", "result", "saddr", "fam", "laddr", "lport", "path", "family",
+	"table", "entries", "old", "new", "sauid", "hook", "kind",
+	"old-auid", "old-ses", "tclass", "scontext", "tcontext",
+	"permissive", "seresult", "seperm", "seqno", "unit", "id",
+	"grantors", "fd0", "fd1", "fd", "flags", "sig", "opid", "oauid",
+	"oses", "obj_uid", "obj_gid", "ocomm", "new-enabled", "old-enabled",
+	"new-disabled", "enforcing", "old_enforcing", "audit_enabled",
+	"auditd_pid", "ver", "format", "kernel", "state", "reason", "list",
+	"ino", "sw", "sw_type", "root_dir", "cipher", "ksize", "mac", "pfs",
+	"spid", "rport", "direction", "old_prom", "prom", "new_pe", "new_pi",
+	"new_pp", "fver", "frootid", "nlnk-fam", "nlnk-grp", "nlnk-pid",
+	"src", "dst", "proto", "mark", "vm", "vm-pid", "vm-ctx", "img-ctx",
+	"resrc", "virt", "uuid",
+};
+
+static GHashTable *interned_keys = NULL;
+
+#ifdef RECORD_LAYOUTS
+/*
+ * Field layouts of the most frequent record types, generated from
+ * record_layouts.txt by make LAYOUTS=1. Fields of a record with a layout
+ * are matched against it in order, which is mostly a single string
+ * compare, instead of being hashed and looked up in interned_keys.
+ */
+struct record_layout {
+	const char *const *fields;
+	unsigned int count;
+};
+
+#include "record_layouts.h"
+#endif
 
 static int print_stats=0;
 static int print_stats_freq=60;
 static int queue_max_length=10000;
-static unsigned int queue_max_length_seen = 0;
+static unsigned long queue_max_length_seen = 0;
+
+/*
+ * Memory bound of the queue. Every queued record is accounted with the
+ * size of its header and arena contents (JALoP structures, message and
+ * parameters), which differ by well over an order of magnitude between
+ * record types. Once the queue passes queue_high_watermark percent of
+ * either limit the parser sheds shed_types records and, with a spool,
+ * spills to disk; that lasts until it drains below queue_low_watermark.
+ * Only at the limits themselves does it wait and then drop.
+ */
+static int queue_max_bytes = 0;
+static int queue_high_watermark = 90;
+static int queue_low_watermark = 70;
+static unsigned long queue_bytes = 0;
+static unsigned long queue_max_bytes_seen = 0;
+static int queue_congested = 0;
+static int sender_threads = 1;
+static int batch_max_records = 1;
+static int batch_max_delay_ms = 0;
+
+/*
+ * Seconds senders get to finish the records in hand on reload, and to
+ * empty the queue on shutdown, before they are cancelled. Records left
+ * in the queue at exit are written to the spool, if there is one.
+ */
+static int drain_timeout = 5;
+static int senders_running = 0;
+
+/*
+ * Settings a JALoP context is built from. On reload the contexts are only
+ * rebuilt if one of these changed. The key and cert are read once, when
+ * the settings are loaded, and every context is built from that copy, so
+ * all senders sign with the same key and the identity compared on the
+ * next reload is that of the file that was read.
+ */
+struct connection_config {
+	char *socket;
+	char *schemas;
+	char *keypath;
+	char *certpath;
+	struct stat key_identity;
+	struct stat cert_identity;
+	char *key_pem;
+	size_t key_pem_len;
+	char *cert_pem;
+	size_t cert_pem_len;
+};
+
+/*
+ * A sender thread and its context. A context built on reload is handed
+ * over through next_ctx and swapped in by the sender between records,
+ * so sends in flight are not interrupted. running is cleared by the
+ * thread when it exits; started is owned by main(). After a send fails
+ * for want of a connection, the sender waits backoff_ms before it tries
+ * again, from reconnect_min_ms doubling up to reconnect_max_ms.
+ */
+struct sender {
+	pthread_t thread;
+	jalp_context *ctx;
+	jalp_context *next_ctx;
+	int running;
+	int started;
+	int backoff_ms;
+	unsigned int failures;
+	unsigned int seed;
+	int index;
+};
+
+static int reconnect_min_ms = 100;
+static int reconnect_max_ms = 30000;
+
+/*
+ * An audit record cannot have an empty payload, unlike a log record. By
+ * default every record carries the same placeholder, because the
+ * application metadata already includes the original auditd message plus
+ * each key/value pair extracted from the message in the "StructuredData"
+ * node. With payload = "record" the raw record text is sent as the
+ * payload as well.
+ */
+#define PAYLOAD_PLACEHOLDER 0
+#define PAYLOAD_RECORD 1
+static const uint8_t placeholder_payload[] = "see app-meta";
+static int payload_mode = PAYLOAD_PLACEHOLDER;
+
+/*
+ * With aggregate = "event", all records of one auparse event are sent as
+ * a single JALoP record with one structured data element per record.
+ */
+#define AGGREGATE_RECORD 0
+#define AGGREGATE_EVENT 1
+static int aggregate_mode = AGGREGATE_RECORD;
+
+/*
+ * With convert = "sender", parsers only pack the text and fields of a
+ * record in the form records take in the spool, and the senders build
+ * the JALoP structures from that right before jalp_audit().
+ */
+#define CONVERT_PARSER 0
+#define CONVERT_SENDER 1
+static int convert_mode = CONVERT_PARSER;
+
+/*
+ * What a parser does with a record that finds no room in its lane: wait
+ * up to overload_timeout seconds for a sender to make room (block), or,
+ * never waiting, drop it (drop_newest), drop the oldest record of its
+ * lane (drop_oldest) or of the lowest priority lane whose records make
+ * room (drop_lowest_priority). With spill, records go to the spool while
+ * the queue is congested and the parser only waits once that is full.
+ * At most OVERLOAD_EVICT_MAX queued records are dropped for one record.
+ */
+#define OVERLOAD_BLOCK 0
+#define OVERLOAD_DROP_NEWEST 1
+#define OVERLOAD_DROP_OLDEST 2
+#define OVERLOAD_DROP_LOWEST 3
+#define OVERLOAD_SPILL 4
+#define OVERLOAD_EVICT_MAX 16
+static int overload_policy = OVERLOAD_BLOCK;
+static int overload_timeout = 5;
+
+/*
+ * Optional metrics endpoint in Prometheus text format, served over HTTP
+ * on a Unix socket (stats_socket) and/or a TCP address (stats_listen,
+ * "host:port").
+ */
+static char *stats_socket = NULL;
+static char *stats_listen = NULL;
+
+/*
+ * Optional overflow spool. With overload_policy = "spill", while the
+ * queue is congested, records are appended in serialized form to
+ * memory-mapped segment files in spool_dir instead of blocking the
+ * parser, and the senders drain them in order once the queue is empty.
+ * As long as the spool holds records, new records go to the spool as
+ * well so that nothing overtakes them.
+ */
+static char *spool_dir = NULL;
+static int spool_segment_size = 16 * 1024 * 1024;
+static int spool_max_segments = 64;
+
+/*
+ * Each spooled record starts with a header. The record is written first
+ * and the state last, so a reader (or a restart after a crash) never sees
+ * a partial record; consumed records are marked done in place. A zero
+ * state marks the end of the data in a segment. Segments are never
+ * msync'ed, so this covers a crash of the process but not of the system:
+ * after a power loss, records the kernel had not written back are lost,
+ * and a segment that fails validation is set aside with a .corrupt suffix.
+ */
+#define SPOOL_SUFFIX ".spool"
+#define SPOOL_FIRST_SEQ 0x10000000UL
+#define SPOOL_ALIGN 8
+#define SPOOL_RECORD_READY 0x4a414c52
+#define SPOOL_RECORD_DONE 0x4a414c44
 
-static void sig_handle(int sig)
+struct spool_header {
+	uint32_t state;
+	uint32_t len;
+	uint32_t nsd;
+	uint32_t reserved;
+	int64_t enqueued_ns;
+};
+
+struct spool_segment {
+	unsigned long seq;
+	int fd;
+	char *base;
+	size_t size;
+	size_t pos;
+};
+
+struct spool {
+	pthread_mutex_t lock;
+	char *path;
+	int dir_fd;
+	unsigned long first_seq;
+	unsigned long next_seq;
+	unsigned long records;
+	struct spool_segment read;
+	struct spool_segment write;
+};
+
+static struct spool *spool = NULL;
+
+/*
+ * Records, events and fields dropped before conversion. Record types are
+ * resolved to their numeric values when the config is loaded so the per
+ * record check is a bit test on auparse_get_type(). exclude_keys holds
+ * audit rule keys whose whole event is dropped, and exclude_fields maps a
+ * field name to the record types it is suppressed in.
+ */
+#define AUDIT_TYPE_MAX 4096
+#define TYPE_BIT_SET(map, type) ((map)[(type) / 8] |= (1 << ((type) % 8)))
+#define TYPE_BIT_CLEAR(map, type) ((map)[(type) / 8] &= ~(1 << ((type) % 8)))
+#define TYPE_BIT_TEST(map, type) ((map)[(type) / 8] & (1 << ((type) % 8)))
+#define TYPE_BIT_ASSIGN(map, type, on) do { \
+		if (on) { \
+			TYPE_BIT_SET(map, type); \
+		} else { \
+			TYPE_BIT_CLEAR(map, type); \
+		} \
+	} while (0)
+
+struct field_filter {
+	int any_type;
+	unsigned char types[AUDIT_TYPE_MAX / 8];
+};
+
+static unsigned char dropped_types[AUDIT_TYPE_MAX / 8];
+static int drop_unlisted_types = 0;
+static unsigned char shed_types[AUDIT_TYPE_MAX / 8];
+static __thread int event_shed = 0;
+
+/*
+ * Priority classes by record type and the weights of the sender's
+ * round robin over the lanes.
+ */
+static unsigned char high_priority_types[AUDIT_TYPE_MAX / 8];
+static unsigned char low_priority_types[AUDIT_TYPE_MAX / 8];
+static int lane_weights[LANE_COUNT] = { 4, 2, 1 };
+static __thread unsigned int lane_turn = 0;
+static GHashTable *excluded_keys = NULL;
+static GHashTable *excluded_fields = NULL;
+
+/*
+ * Fields of interpret_fields get a second parameter, named in upper case
+ * as in auditd's enriched format, holding auparse's interpretation of the
+ * value: user names for uids, proctitle decoded and so on. auparse keeps
+ * the caches behind it in globals, so parsers take turns.
+ */
+static GHashTable *interpreted_fields = NULL;
+static pthread_mutex_t interpret_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Coalescing of repeated events, keyed on the values of coalesce_fields
+ * (the first occurrence of each in the event). The first event of a key
+ * is sent as usual and opens a window of coalesce_window_ms. The first
+ * repeat within the window is converted but held back, later ones are
+ * only counted; once the window has closed, the held records are sent,
+ * the first of them with repeat_count, first_time and last_time
+ * parameters added. Every thread that parses keeps a table of its own,
+ * with at most coalesce_max_entries keys; events of any other key pass
+ * through. event_hold, while set, is where converted records are held
+ * instead of being queued.
+ */
+#define EVENT_KEY_MAX 1024
+#define COALESCE_PASS 0
+#define COALESCE_HOLD 1
+#define COALESCE_DROP 2
+
+struct coalesce_entry {
+	long long window_end_ms;
+	struct audit_record *held;
+	unsigned long repeats;
+	char first_time[32];
+	char last_time[32];
+};
+
+struct coalescer {
+	GHashTable *entries;
+};
+
+static char **coalesce_fields = NULL;
+static int coalesce_field_count = 0;
+static int coalesce_window_ms = 1000;
+static int coalesce_max_entries = 1024;
+static __thread struct audit_record **event_hold = NULL;
+
+/*
+ * Rate limiting, with a token bucket per source keyed on the values of
+ * rate_limit_fields. Buckets hold up to rate_limit_burst tokens and are
+ * refilled at rate_limit tokens per second; an event finding its bucket
+ * empty is suppressed before it is converted. Every thread that parses
+ * keeps buckets of its own, each with an even share of the rate and
+ * burst, for at most rate_limit_max_sources sources; events of any other
+ * source pass through.
+ */
+struct rate_bucket {
+	long long refill_ms;
+	double tokens;
+};
+
+struct limiter {
+	GHashTable *buckets;
+};
+
+static char **rate_limit_fields = NULL;
+static int rate_limit_field_count = 0;
+static int rate_limit = 0;
+static int rate_limit_burst = 0;
+static int rate_limit_max_sources = 1024;
+
+#define SKIP_NONE 0
+#define SKIP_EOE 1
+#define SKIP_FILTERED 2
+#define SKIP_SHED 3
+
+/*
+ * Log-linear latency histograms: values below HIST_SUB_COUNT get a bucket
+ * each, above that every power of two is split into HIST_SUB_COUNT
+ * buckets, which bounds the error of a reported percentile to 12.5%.
+ */
+#define HIST_SUB_BITS 3
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+struct histogram {
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t max;
+	uint64_t sum;
+};
+
+/*
+ * Counters and histograms of one thread. Only the owning thread writes
+ * to its block, so updates are plain relaxed stores; log_stats sums all
+ * blocks when it reports. Blocks of exited threads are kept (and
+ * reused by the next thread), so totals survive reloads.
+ */
+struct thread_stats {
+	int in_use;
+	struct thread_stats *next;
+	uint64_t input_reads CACHE_ALIGNED;
+	uint64_t input_bytes;
+	uint64_t input_overruns;
+	uint64_t records_parsed;
+	uint64_t records_filtered;
+	uint64_t records_shed;
+	uint64_t events_filtered;
+	uint64_t events_coalesced;
+	uint64_t events_limited;
+	uint64_t records_enqueued;
+	uint64_t records_dropped;
+	uint64_t records_spilled;
+	uint64_t records_sent;
+	uint64_t send_failures;
+	uint64_t reloads;
+	struct histogram enqueue_wait;
+	struct histogram residence;
+	struct histogram send_time;
+};
+
+static struct thread_stats *stats_list = NULL;
+static __thread struct thread_stats *my_stats = NULL;
+
+#define STAT_ADD(field, n) \
+	__atomic_store_n(&my_stats->field, \
+		__atomic_load_n(&my_stats->field, __ATOMIC_RELAXED) + (n), \
+		__ATOMIC_RELAXED)
+#define STAT_INC(field) STAT_ADD(field, 1)
+
+static struct ring *ring_create(unsigned long capacity)
+{
+	struct ring *r = NULL;
+	unsigned long i;
+
+	if (capacity == 0) {
+		return NULL;
+	}
+
+	if (posix_memalign((void **)&r, CACHE_LINE_SIZE, sizeof(*r)) != 0) {
+		return NULL;
+	}
+	memset(r, 0, sizeof(*r));
+	r->data_fd = -1;
+	r->space_fd = -1;
+
+	r->cells = calloc(capacity, sizeof(*r->cells));
+	if (!r->cells) {
+		goto err;
+	}
+	for (i = 0; i < capacity; i++) {
+		r->cells[i].seq = i;
+	}
+	r->capacity = capacity;
+
+	r->data_fd = eventfd(0, EFD_SEMAPHORE | EFD_CLOEXEC);
+	r->space_fd = eventfd(0, EFD_SEMAPHORE | EFD_CLOEXEC);
+	if (r->data_fd < 0 || r->space_fd < 0) {
+		goto err;
+	}
+	return r;
+err:
+	if (r->data_fd >= 0) {
+		close(r->data_fd);
+	}
+	if (r->space_fd >= 0) {
+		close(r->space_fd);
+	}
+	free(r->cells);
+	free(r);
+	return NULL;
+}
+
+static void ring_destroy(struct ring **r)
 {
-	switch (sig) {
-	case SIGTERM:
-		status = STOP;
-		break;
-	case SIGHUP:
-		status = RELOAD;
-		break;
-	default:
-		break;
+	if (!r || !*r) {
+		return;
 	}
+	close((*r)->data_fd);
+	close((*r)->space_fd);
+	free((*r)->cells);
+	free(*r);
+	*r = NULL;
 }
 
-static void audit_event_handle(auparse_state_t *au,
-			auparse_cb_event_t event_type,
-			void *user_data)
+static unsigned long ring_length(struct ring *r)
 {
-	UNUSED(user_data);
-	struct jalp_app_metadata *app_data = NULL;
-	struct jalp_logger_metadata *log_data = NULL;
-	struct jalp_param *param_list = NULL;
-	struct jalp_param *param = NULL;
+	unsigned long tail = __atomic_load_n(&r->enqueue_pos, __ATOMIC_RELAXED);
+	unsigned long head = __atomic_load_n(&r->dequeue_pos, __ATOMIC_RELAXED);
 
-	struct timespec timeout;
+	return (tail > head) ? tail - head : 0;
+}
 
-	if (event_type != AUPARSE_CB_EVENT_READY) {
+static void ring_wake(int *waiters, int fd)
+{
+	uint64_t one = 1;
+
+	// Pairs with the increment of the waiter count in ring_wait(): either
+	// the sleeper sees our update on its re-check, or we see the sleeper.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiters, __ATOMIC_RELAXED) > 0) {
+		if (write(fd, &one, sizeof(one)) < 0) {
+			syslog(LOG_ERR, "failure waking queue waiter: %s", strerror(errno));
+		}
+	}
+}
+
+static int ring_try_push(struct ring *r, void *data)
+{
+	struct ring_cell *cell;
+	unsigned long pos = __atomic_load_n(&r->enqueue_pos, __ATOMIC_RELAXED);
+	unsigned long seq;
+	long diff;
+
+	for (;;) {
+		cell = &r->cells[pos % r->capacity];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		diff = (long)seq - (long)pos;
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&r->enqueue_pos, &pos, pos + 1, 1,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (diff < 0) {
+			return -1;
+		} else {
+			pos = __atomic_load_n(&r->enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+	cell->data = data;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	ring_wake(&r->data_waiters, r->data_fd);
+	return 0;
+}
+
+static void *ring_try_pop(struct ring *r)
+{
+	struct ring_cell *cell;
+	unsigned long pos = __atomic_load_n(&r->dequeue_pos, __ATOMIC_RELAXED);
+	unsigned long seq;
+	long diff;
+	void *data;
+
+	for (;;) {
+		cell = &r->cells[pos % r->capacity];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		diff = (long)seq - (long)(pos + 1);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&r->dequeue_pos, &pos, pos + 1, 1,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (diff < 0) {
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&r->dequeue_pos, __ATOMIC_RELAXED);
+		}
+	}
+	data = cell->data;
+	__atomic_store_n(&cell->seq, pos + r->capacity, __ATOMIC_RELEASE);
+	ring_wake(&r->space_waiters, r->space_fd);
+	return data;
+}
+
+static void ring_waiter_cleanup(void *waiters)
+{
+	__atomic_sub_fetch((int *)waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Sleep on fd until woken or timeout_ms elapses (-1 for no timeout).
+ * The caller re-checks the ring through check() after announcing itself
+ * as a waiter so a wakeup sent in between is never lost. Returns 1 if
+ * check() succeeded, 0 otherwise.
+ */
+static int ring_wait(struct ring *r, int *waiters, int fd, int timeout_ms,
+		int (*check)(struct ring *, void **), void **out)
+{
+	struct pollfd pfd;
+	uint64_t token;
+	int ready;
+
+	__atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+	ready = check(r, out);
+	if (!ready && !__atomic_load_n(&r->interrupted, __ATOMIC_SEQ_CST)) {
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		// poll() is a cancellation point, so a sender blocked here can
+		// still be torn down on reload.
+		pthread_cleanup_push(ring_waiter_cleanup, waiters);
+		if (poll(&pfd, 1, timeout_ms) > 0) {
+			if (read(fd, &token, sizeof(token)) < 0 && errno != EAGAIN) {
+				syslog(LOG_ERR, "failure reading queue wakeup: %s", strerror(errno));
+			}
+		}
+		pthread_cleanup_pop(0);
+	}
+	ring_waiter_cleanup(waiters);
+	return ready;
+}
+
+/*
+ * Set or clear the interrupted state. While it is set, ring_pop() and
+ * ring_pop_batch() return without waiting for (or taking) more entries.
+ */
+static void ring_interrupt(struct ring *r, int on)
+{
+	uint64_t waiters;
+
+	__atomic_store_n(&r->interrupted, on, __ATOMIC_SEQ_CST);
+	if (!on) {
 		return;
 	}
+	// Pairs with the waiter count increment in ring_wait(), as in
+	// ring_wake(), but wakes every consumer at once.
+	waiters = __atomic_load_n(&r->data_waiters, __ATOMIC_SEQ_CST);
+	if (waiters > 0 && write(r->data_fd, &waiters, sizeof(waiters)) < 0) {
+		syslog(LOG_ERR, "failure waking queue waiters: %s", strerror(errno));
+	}
+}
 
-	auparse_first_record(au);
-	do {
-		app_data = jalp_app_metadata_create();
-		if (!app_data) {
-			syslog(LOG_ERR, "failure creating JALP application metadata");
-			goto out;
+static int ring_interrupted(struct ring *r)
+{
+	return __atomic_load_n(&r->interrupted, __ATOMIC_SEQ_CST);
+}
+
+static long long monotonic_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static long long monotonic_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * CPUs, scheduling policy and nice value of each class of thread, from
+ * <class>_cpus, <class>_policy and <class>_nice. The input thread is
+ * main(), which also parses with parser_threads = 1; the stats threads
+ * are log_stats and the exporter. Each thread applies the settings of
+ * its class when it starts, the input thread also on every reload, and
+ * settings that are not given are left alone. Memory is placed on the
+ * NUMA node of the thread that first writes to it, which for the queue
+ * is the input thread, set up before the queue is created.
+ */
+#define THREAD_INPUT 0
+#define THREAD_PARSER 1
+#define THREAD_SENDER 2
+#define THREAD_STATS 3
+#define THREAD_CLASS_COUNT 4
+
+struct thread_class {
+	const char *name;
+	int set_cpus;
+	cpu_set_t cpus;
+	int set_policy;
+	int policy;
+	int priority;
+	int set_nice;
+	int nice;
+};
+
+static struct thread_class thread_classes[THREAD_CLASS_COUNT] = {
+	{ .name = "input" },
+	{ .name = "parser" },
+	{ .name = "sender" },
+	{ .name = "stats" },
+};
+
+/* Name the calling thread, unless name is NULL, and apply its class. */
+static void thread_setup(int class, const char *name)
+{
+	struct thread_class *tc = &thread_classes[class];
+	struct sched_param param;
+	int rc;
+
+	if (name) {
+		pthread_setname_np(pthread_self(), name);
+	}
+	if (tc->set_cpus) {
+		rc = pthread_setaffinity_np(pthread_self(), sizeof(tc->cpus), &tc->cpus);
+		if (rc != 0) {
+			syslog(LOG_ERR, "failure setting CPUs of %s thread: %s", tc->name,
+					strerror(rc));
+		}
+	}
+	if (tc->set_policy) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = tc->priority;
+		rc = pthread_setschedparam(pthread_self(), tc->policy, &param);
+		if (rc != 0) {
+			syslog(LOG_ERR, "failure setting scheduling policy of %s thread: %s",
+					tc->name, strerror(rc));
+		}
+	}
+	if (tc->set_nice && setpriority(PRIO_PROCESS, syscall(SYS_gettid), tc->nice) < 0) {
+		syslog(LOG_ERR, "failure setting nice value of %s thread: %s", tc->name,
+				strerror(errno));
+	}
+}
+
+/*
+ * Push data, waiting at most timeout_sec seconds for space. check pushes
+ * *out without blocking and returns whether there was room. Returns 0 on
+ * success and -1 if the queue is still full.
+ */
+static int ring_push(struct ring *r, void *data, int timeout_sec,
+		int (*check)(struct ring *, void **))
+{
+	long long deadline;
+	long long remaining_ms;
+
+	if (check(r, &data)) {
+		return 0;
+	}
+
+	deadline = monotonic_ms() + (long long)timeout_sec * 1000;
+	while ((remaining_ms = deadline - monotonic_ms()) > 0) {
+		if (ring_wait(r, &r->space_waiters, r->space_fd, (int)remaining_ms,
+				check, &data)) {
+			return 0;
+		}
+	}
+
+	return check(r, &data) ? 0 : -1;
+}
+
+/*
+ * Pop the oldest entry, sleeping until one is available. check pops one
+ * entry without blocking and returns whether it got one. Returns NULL
+ * once the ring is interrupted.
+ */
+static void *ring_pop(struct ring *r, int (*check)(struct ring *, void **))
+{
+	void *data = NULL;
+
+	while (!data && !ring_interrupted(r)) {
+		if (!check(r, &data)) {
+			ring_wait(r, &r->data_waiters, r->data_fd, -1, check, &data);
 		}
+	}
+	return data;
+}
+
+/*
+ * Pop between 1 and max entries into items. Sleeps until the first entry
+ * arrives, then keeps collecting for up to delay_ms so that bursts are
+ * handed to the sender in one go. Returns the number of entries popped,
+ * which is 0 only if the ring was interrupted.
+ */
+static unsigned int ring_pop_batch(struct ring *r, void **items, unsigned int max,
+		int delay_ms, int (*check)(struct ring *, void **))
+{
+	unsigned int n = 0;
+	long long deadline;
+	long long remaining_ms;
+
+	items[n] = ring_pop(r, check);
+	if (!items[n]) {
+		return 0;
+	}
+	n++;
+	deadline = monotonic_ms() + delay_ms;
+	while (n < max && !ring_interrupted(r)) {
+		if (check(r, &items[n])) {
+			n++;
+			continue;
+		}
+		remaining_ms = deadline - monotonic_ms();
+		if (remaining_ms <= 0) {
+			break;
+		}
+		if (ring_wait(r, &r->data_waiters, r->data_fd, (int)remaining_ms,
+				check, &items[n])) {
+			n++;
+		}
+	}
+	return n;
+}
+
+static unsigned int hist_index(uint64_t value)
+{
+	int msb;
+
+	if (value < HIST_SUB_COUNT) {
+		return (unsigned int)value;
+	}
+	msb = 63 - __builtin_clzll(value);
+	return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+		+ ((value >> (msb - HIST_SUB_BITS)) & (HIST_SUB_COUNT - 1));
+}
+
+/* Smallest value that falls into bucket index. */
+static uint64_t hist_value(unsigned int index)
+{
+	unsigned int group = index >> HIST_SUB_BITS;
+	int msb;
+
+	if (group == 0) {
+		return index;
+	}
+	msb = group + HIST_SUB_BITS - 1;
+	return (1ULL << msb) + ((uint64_t)(index & (HIST_SUB_COUNT - 1)) << (msb - HIST_SUB_BITS));
+}
+
+static void hist_record(struct histogram *h, long long value)
+{
+	uint64_t v = value > 0 ? (uint64_t)value : 0;
+	unsigned int i = hist_index(v);
+
+	__atomic_store_n(&h->counts[i],
+			__atomic_load_n(&h->counts[i], __ATOMIC_RELAXED) + 1,
+			__ATOMIC_RELAXED);
+	__atomic_store_n(&h->sum, __atomic_load_n(&h->sum, __ATOMIC_RELAXED) + v,
+			__ATOMIC_RELAXED);
+	if (v > __atomic_load_n(&h->max, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+	}
+}
+
+static void hist_sum(struct histogram *sum, struct histogram *h)
+{
+	unsigned int i;
+	uint64_t max;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		sum->counts[i] += __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+	}
+	max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	sum->max = MAX(sum->max, max);
+	sum->sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+}
+
+static uint64_t hist_percentile(struct histogram *h, double percent)
+{
+	uint64_t total = 0;
+	uint64_t seen = 0;
+	uint64_t target;
+	unsigned int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		total += h->counts[i];
+	}
+	if (total == 0) {
+		return 0;
+	}
+	target = (uint64_t)(total * percent / 100.0);
+	if (target == 0) {
+		target = 1;
+	}
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen >= target) {
+			return MIN(hist_value(i), h->max);
+		}
+	}
+	return h->max;
+}
+
+/* Attach a statistics block to the calling thread. */
+static int stats_acquire(void)
+{
+	struct thread_stats *stats;
+	int unused = 0;
+
+	for (stats = __atomic_load_n(&stats_list, __ATOMIC_ACQUIRE); stats; stats = stats->next) {
+		unused = 0;
+		if (__atomic_compare_exchange_n(&stats->in_use, &unused, 1, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			my_stats = stats;
+			return 0;
+		}
+	}
+
+	if (posix_memalign((void **)&stats, CACHE_LINE_SIZE, sizeof(*stats)) != 0) {
+		return -1;
+	}
+	memset(stats, 0, sizeof(*stats));
+	stats->in_use = 1;
+	stats->next = __atomic_load_n(&stats_list, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&stats_list, &stats->next, stats, 1,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		;
+	}
+	my_stats = stats;
+	return 0;
+}
+
+static void stats_release(void *ptr)
+{
+	UNUSED(ptr);
+	if (my_stats) {
+		__atomic_store_n(&my_stats->in_use, 0, __ATOMIC_RELEASE);
+		my_stats = NULL;
+	}
+}
 
-		app_data->type = JALP_METADATA_LOGGER;
+static void stats_destroy(void)
+{
+	struct thread_stats *stats;
+
+	while (stats_list) {
+		stats = stats_list;
+		stats_list = stats->next;
+		free(stats);
+	}
+}
+
+/* Sum the blocks of every thread into total. */
+static void stats_collect(struct thread_stats *total)
+{
+	struct thread_stats *stats;
+
+	memset(total, 0, sizeof(*total));
+	for (stats = __atomic_load_n(&stats_list, __ATOMIC_ACQUIRE); stats; stats = stats->next) {
+		total->input_reads += __atomic_load_n(&stats->input_reads, __ATOMIC_RELAXED);
+		total->input_bytes += __atomic_load_n(&stats->input_bytes, __ATOMIC_RELAXED);
+		total->input_overruns += __atomic_load_n(&stats->input_overruns, __ATOMIC_RELAXED);
+		total->records_parsed += __atomic_load_n(&stats->records_parsed, __ATOMIC_RELAXED);
+		total->records_filtered += __atomic_load_n(&stats->records_filtered, __ATOMIC_RELAXED);
+		total->records_shed += __atomic_load_n(&stats->records_shed, __ATOMIC_RELAXED);
+		total->events_filtered += __atomic_load_n(&stats->events_filtered, __ATOMIC_RELAXED);
+		total->events_coalesced += __atomic_load_n(&stats->events_coalesced, __ATOMIC_RELAXED);
+		total->events_limited += __atomic_load_n(&stats->events_limited, __ATOMIC_RELAXED);
+		total->records_enqueued += __atomic_load_n(&stats->records_enqueued, __ATOMIC_RELAXED);
+		total->records_dropped += __atomic_load_n(&stats->records_dropped, __ATOMIC_RELAXED);
+		total->records_spilled += __atomic_load_n(&stats->records_spilled, __ATOMIC_RELAXED);
+		total->records_sent += __atomic_load_n(&stats->records_sent, __ATOMIC_RELAXED);
+		total->send_failures += __atomic_load_n(&stats->send_failures, __ATOMIC_RELAXED);
+		total->reloads += __atomic_load_n(&stats->reloads, __ATOMIC_RELAXED);
+		hist_sum(&total->enqueue_wait, &stats->enqueue_wait);
+		hist_sum(&total->residence, &stats->residence);
+		hist_sum(&total->send_time, &stats->send_time);
+	}
+}
+
+/* Count a record or chunk of seg, if it belongs to a replay, in flight. */
+static void replay_hold(struct replay_segment *seg)
+{
+	if (seg) {
+		__atomic_add_fetch(&seg->outstanding, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Count a record or chunk of seg as done with. A lost one keeps the
+ * checkpoint from moving past seg.
+ */
+static void replay_release(struct replay_segment *seg, int lost)
+{
+	if (!seg) {
+		return;
+	}
+	if (lost) {
+		__atomic_store_n(&seg->lost, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_sub_fetch(&seg->outstanding, 1, __ATOMIC_RELEASE);
+}
+
+static void record_reset(struct audit_record *rec)
+{
+	struct arena_block *block;
+
+	while (rec->extra) {
+		block = rec->extra;
+		rec->extra = block->next;
+		free(block);
+	}
+	memset(&rec->app, 0, sizeof(rec->app));
+	memset(&rec->log, 0, sizeof(rec->log));
+	memset(&rec->sd, 0, sizeof(rec->sd));
+	rec->cur = rec->data;
+	rec->end = (char *)rec + RECORD_BLOCK_SIZE;
+	rec->bytes = 0;
+	rec->packed = NULL;
+	rec->packed_index = 0;
+	rec->packed_nsd = 0;
+	rec->next = NULL;
+	rec->segment = NULL;
+	rec->lane = LANE_NORMAL;
+}
+
+static struct audit_record *record_alloc(void)
+{
+	struct audit_record *rec = NULL;
+
+	if (record_pool) {
+		rec = ring_try_pop(record_pool);
+	}
+	if (!rec) {
+		rec = malloc(RECORD_BLOCK_SIZE);
+		if (!rec) {
+			return NULL;
+		}
+		rec->extra = NULL;
+		record_reset(rec);
+	}
+	return rec;
+}
+
+static void record_release(struct audit_record **rec)
+{
+	if (!rec || !*rec) {
+		return;
+	}
+	replay_release((*rec)->segment, 0);
+	record_reset(*rec);
+	if (!record_pool || ring_try_push(record_pool, *rec) < 0) {
+		free(*rec);
+	}
+	*rec = NULL;
+}
+
+/* Release a record that is not going to be sent. */
+static void record_discard(struct audit_record **rec)
+{
+	if (!rec || !*rec) {
+		return;
+	}
+	replay_release((*rec)->segment, 1);
+	(*rec)->segment = NULL;
+	record_release(rec);
+}
+
+static void record_pool_destroy(void)
+{
+	struct audit_record *rec;
+
+	if (!record_pool) {
+		return;
+	}
+	while ((rec = ring_try_pop(record_pool))) {
+		free(rec);
+	}
+	ring_destroy(&record_pool);
+}
+
+static void *arena_alloc(struct audit_record *rec, size_t size)
+{
+	struct arena_block *block;
+	size_t block_size;
+	void *ptr;
+
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	if ((size_t)(rec->end - rec->cur) < size) {
+		block_size = MAX(size, (size_t)ARENA_BLOCK_SIZE);
+		block = malloc(sizeof(*block) + block_size);
+		if (!block) {
+			return NULL;
+		}
+		block->next = rec->extra;
+		rec->extra = block;
+		rec->cur = block->data;
+		rec->end = block->data + block_size;
+	}
+	ptr = rec->cur;
+	rec->cur += size;
+	rec->bytes += size;
+	return ptr;
+}
+
+static char *arena_strdup(struct audit_record *rec, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *copy = arena_alloc(rec, len);
+
+	if (copy) {
+		memcpy(copy, str, len);
+	}
+	return copy;
+}
+
+static int intern_init(void)
+{
+	size_t i;
+
+	interned_keys = g_hash_table_new(g_str_hash, g_str_equal);
+	if (!interned_keys) {
+		return -1;
+	}
+	for (i = 0; i < sizeof(field_names) / sizeof(field_names[0]); i++) {
+		g_hash_table_insert(interned_keys, (gpointer)field_names[i],
+				(gpointer)field_names[i]);
+	}
+	return 0;
+}
+
+static void intern_destroy(void)
+{
+	if (interned_keys) {
+		g_hash_table_destroy(interned_keys);
+		interned_keys = NULL;
+	}
+}
+
+/* Return the shared copy of key, or NULL if it is not a known field. */
+static const char *intern_key(const char *key)
+{
+	return g_hash_table_lookup(interned_keys, key);
+}
+
+/*
+ * Append a parameter referring to key and value after *tail (or start
+ * the list at *head).
+ */
+static int record_link_param(struct audit_record *rec, struct jalp_param **head,
+		struct jalp_param **tail, char *key, char *value)
+{
+	struct jalp_param *param = arena_alloc(rec, sizeof(*param));
+
+	if (!param) {
+		return -1;
+	}
+	param->key = key;
+	param->value = value;
+	param->next = NULL;
+	if (*tail) {
+		(*tail)->next = param;
+	} else {
+		*head = param;
+	}
+	*tail = param;
+	return 0;
+}
+
+/* Append a copy of a key/value parameter after *tail. */
+static int record_add_param(struct audit_record *rec, struct jalp_param **head,
+		struct jalp_param **tail, const char *key, const char *value)
+{
+	char *key_copy = (char *)intern_key(key);
+	char *value_copy;
+
+	if (!key_copy) {
+		key_copy = arena_strdup(rec, key);
+	}
+	value_copy = arena_strdup(rec, value);
+	if (!key_copy || !value_copy) {
+		return -1;
+	}
+	return record_link_param(rec, head, tail, key_copy, value_copy);
+}
+
+static struct audit_record *record_start(void)
+{
+	struct audit_record *rec = record_alloc();
+
+	if (!rec) {
+		return NULL;
+	}
+	rec->app.type = JALP_METADATA_LOGGER;
+	rec->app.log = &rec->log;
+	rec->log.logger_name = (char *)LOGGER_NAME;
+	rec->log.sd = &rec->sd;
+	rec->sd.sd_id = (char *)SD_ID;
+	rec->segment = replay_current;
+	replay_hold(rec->segment);
+	return rec;
+}
+
+/*
+ * Add a structured data element after *tail. The first element of a
+ * record is the one embedded in it.
+ */
+static struct jalp_structured_data *record_add_sd(struct audit_record *rec,
+		struct jalp_structured_data **tail)
+{
+	struct jalp_structured_data *sd;
+
+	if (!*tail) {
+		*tail = &rec->sd;
+		return *tail;
+	}
+	sd = arena_alloc(rec, sizeof(*sd));
+	if (!sd) {
+		return NULL;
+	}
+	sd->sd_id = (char *)SD_ID;
+	sd->param_list = NULL;
+	sd->next = NULL;
+	(*tail)->next = sd;
+	*tail = sd;
+	return sd;
+}
+
+/* Make a C string of len bytes of the packed form at offset. */
+static char *packed_string(struct audit_record *rec, uint32_t offset, uint16_t len)
+{
+	char *str = arena_alloc(rec, (size_t)len + 1);
+
+	if (str) {
+		memcpy(str, rec->packed + offset, len);
+		str[len] = '\0';
+	}
+	return str;
+}
+
+/* Shared copy of a packed key if it is a known field name, or NULL. */
+static const char *packed_intern(struct audit_record *rec, const struct packed_field *field)
+{
+	char key[PACKED_KEY_MAX];
+
+	if (field->key_len >= sizeof(key)) {
+		return NULL;
+	}
+	memcpy(key, rec->packed + field->key, field->key_len);
+	key[field->key_len] = '\0';
+	return intern_key(key);
+}
+
+/* Build the structured data of a packed record in its arena. */
+static int record_unpack(struct audit_record *rec)
+{
+	struct jalp_structured_data *sd = NULL;
+	struct jalp_param *tail;
+	struct packed_field field;
+	size_t pos = rec->packed_index;
+	char *key;
+	char *value;
+	uint32_t count;
+	uint32_t i;
+	uint32_t j;
+
+	for (i = 0; i < rec->packed_nsd; i++) {
+		if (!record_add_sd(rec, &sd)) {
+			return -1;
+		}
+		tail = NULL;
+		memcpy(&count, rec->packed + pos, sizeof(count));
+		pos += sizeof(count);
+		for (j = 0; j < count; j++, pos += sizeof(field)) {
+			memcpy(&field, rec->packed + pos, sizeof(field));
+			key = (char *)packed_intern(rec, &field);
+			if (!key) {
+				key = packed_string(rec, field.key, field.key_len);
+			}
+			value = packed_string(rec, field.value, field.value_len);
+			if (!key || !value ||
+					record_link_param(rec, &sd->param_list, &tail, key, value) < 0) {
+				return -1;
+			}
+		}
+	}
+	rec->packed = NULL;
+	return 0;
+}
+
+static size_t spool_align(size_t len)
+{
+	return (len + SPOOL_ALIGN - 1) & ~((size_t)SPOOL_ALIGN - 1);
+}
+
+static void spool_segment_name(char *name, size_t size, unsigned long seq)
+{
+	snprintf(name, size, "%016lx" SPOOL_SUFFIX, seq);
+}
+
+/* Map segment seq, creating and preallocating it if create is set. */
+static int spool_segment_open(struct spool_segment *seg, unsigned long seq, int create)
+{
+	char name[32];
+	struct stat st;
+	int flags = create ? O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC : O_RDWR | O_CLOEXEC;
+
+	spool_segment_name(name, sizeof(name), seq);
+	seg->seq = seq;
+	seg->pos = 0;
+	seg->fd = openat(spool->dir_fd, name, flags, 0600);
+	if (seg->fd < 0) {
+		return -1;
+	}
+	if (create) {
+		// Reserve the blocks now; running out of space while writing
+		// through the mapping would raise SIGBUS.
+		if (posix_fallocate(seg->fd, 0, spool_segment_size) != 0) {
+			goto err;
+		}
+	}
+	if (fstat(seg->fd, &st) < 0 || st.st_size < (off_t)sizeof(struct spool_header)) {
+		goto err;
+	}
+	seg->size = st.st_size;
+	seg->base = mmap(NULL, seg->size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+	if (seg->base == MAP_FAILED) {
+		seg->base = NULL;
+		goto err;
+	}
+	return 0;
+err:
+	close(seg->fd);
+	seg->fd = -1;
+	if (create) {
+		unlinkat(spool->dir_fd, name, 0);
+	}
+	return -1;
+}
+
+static void spool_segment_close(struct spool_segment *seg, int remove)
+{
+	char name[32];
+
+	if (seg->base) {
+		munmap(seg->base, seg->size);
+		seg->base = NULL;
+	}
+	if (seg->fd < 0) {
+		return;
+	}
+	close(seg->fd);
+	seg->fd = -1;
+	if (remove) {
+		spool_segment_name(name, sizeof(name), seg->seq);
+		unlinkat(spool->dir_fd, name, 0);
+	}
+}
+
+static struct spool_header *spool_segment_header(struct spool_segment *seg)
+{
+	if (seg->pos + sizeof(struct spool_header) > seg->size) {
+		return NULL;
+	}
+	return (struct spool_header *)(seg->base + seg->pos);
+}
+
+/* Count the unconsumed records from the position of seg on. */
+static unsigned long spool_segment_ready(struct spool_segment *seg)
+{
+	struct spool_header *hdr;
+	unsigned long ready = 0;
+
+	while ((hdr = spool_segment_header(seg)) && hdr->state != 0 &&
+			hdr->len >= sizeof(*hdr) && hdr->len <= seg->size - seg->pos) {
+		if (hdr->state == SPOOL_RECORD_READY) {
+			ready++;
+		}
+		seg->pos += hdr->len;
+	}
+	return ready;
+}
+
+static int spool_pending(void)
+{
+	return spool && __atomic_load_n(&spool->records, __ATOMIC_ACQUIRE) > 0;
+}
+
+/*
+ * Pick up segments left by a previous run: the oldest one becomes the
+ * read segment and new data goes to fresh segments after the newest.
+ */
+static int spool_scan(void)
+{
+	DIR *dir;
+	struct dirent *ent;
+	struct spool_segment seg;
+	unsigned long seq;
+	unsigned long min_seq = 0;
+	unsigned long max_seq = 0;
+	int found = 0;
+	int n;
+
+	dir = opendir(spool->path);
+	if (!dir) {
+		return -1;
+	}
+	while ((ent = readdir(dir))) {
+		if (sscanf(ent->d_name, "%16lx" SPOOL_SUFFIX "%n", &seq, &n) != 1 ||
+				ent->d_name[n] != '\0') {
+			continue;
+		}
+		if (!found || seq < min_seq) {
+			min_seq = seq;
+		}
+		if (!found || seq > max_seq) {
+			max_seq = seq;
+		}
+		found = 1;
+		if (spool_segment_open(&seg, seq, 0) < 0) {
+			syslog(LOG_ERR, "failure opening spool segment %s", ent->d_name);
+			continue;
+		}
+		spool->records += spool_segment_ready(&seg);
+		spool_segment_close(&seg, 0);
+	}
+	closedir(dir);
+
+	// A fresh spool leaves room below its first segment for records
+	// prepended at shutdown.
+	spool->first_seq = found ? max_seq + 1 : SPOOL_FIRST_SEQ;
+	spool->next_seq = spool->first_seq;
+	spool->read.seq = found ? min_seq : spool->first_seq;
+	if (spool->records) {
+		syslog(LOG_INFO, "replaying %lu spooled records", spool->records);
+	}
+	return 0;
+}
+
+static void spool_close(void)
+{
+	int empty;
+
+	if (!spool) {
+		return;
+	}
+	empty = spool->records == 0;
+	// Segments that still hold records stay behind for the next run.
+	spool_segment_close(&spool->read, empty);
+	spool_segment_close(&spool->write, empty);
+	if (spool->dir_fd >= 0) {
+		close(spool->dir_fd);
+	}
+	pthread_mutex_destroy(&spool->lock);
+	free(spool->path);
+	free(spool);
+	spool = NULL;
+}
+
+static int spool_open(const char *path)
+{
+	spool = calloc(1, sizeof(*spool));
+	if (!spool) {
+		return -1;
+	}
+	pthread_mutex_init(&spool->lock, NULL);
+	spool->dir_fd = -1;
+	spool->read.fd = -1;
+	spool->write.fd = -1;
+	spool->path = strdup(path);
+	if (!spool->path) {
+		goto err;
+	}
+	if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+		syslog(LOG_ERR, "failure creating spool directory %s: %s", path, strerror(errno));
+		goto err;
+	}
+	spool->dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (spool->dir_fd < 0) {
+		syslog(LOG_ERR, "failure opening spool directory %s: %s", path, strerror(errno));
+		goto err;
+	}
+	if (spool_scan() < 0) {
+		syslog(LOG_ERR, "failure reading spool directory %s", path);
+		goto err;
+	}
+	return 0;
+err:
+	spool_close();
+	return -1;
+}
+
+/*
+ * Write the parameters of a packed record at pos in serialized form, or
+ * only measure them if pos is NULL. Returns their serialized size.
+ */
+static size_t spool_put_packed(struct audit_record *rec, char *pos)
+{
+	struct packed_field field;
+	size_t index = rec->packed_index;
+	size_t len = 0;
+	uint32_t count;
+	uint32_t i;
+	uint32_t j;
+
+	for (i = 0; i < rec->packed_nsd; i++) {
+		memcpy(&count, rec->packed + index, sizeof(count));
+		index += sizeof(count);
+		if (pos) {
+			memcpy(pos + len, &count, sizeof(count));
+		}
+		len += sizeof(count);
+		for (j = 0; j < count; j++, index += sizeof(field)) {
+			memcpy(&field, rec->packed + index, sizeof(field));
+			if (pos) {
+				memcpy(pos + len, rec->packed + field.key, field.key_len);
+				len += field.key_len;
+				pos[len++] = '\0';
+				memcpy(pos + len, rec->packed + field.value, field.value_len);
+				len += field.value_len;
+				pos[len++] = '\0';
+			} else {
+				len += field.key_len + field.value_len + 2;
+			}
+		}
+	}
+	return len;
+}
+
+static size_t spool_record_size(struct audit_record *rec)
+{
+	struct jalp_structured_data *sd;
+	struct jalp_param *param;
+	size_t len = sizeof(struct spool_header) + strlen(rec->log.message) + 1;
+
+	if (rec->packed) {
+		return spool_align(len + spool_put_packed(rec, NULL));
+	}
+	for (sd = rec->log.sd; sd; sd = sd->next) {
+		len += sizeof(uint32_t);
+		for (param = sd->param_list; param; param = param->next) {
+			len += strlen(param->key) + strlen(param->value) + 2;
+		}
+	}
+	return spool_align(len);
+}
+
+static char *spool_put_string(char *pos, const char *str)
+{
+	size_t len = strlen(str) + 1;
+
+	memcpy(pos, str, len);
+	return pos + len;
+}
+
+/*
+ * Serialized record: the message, then for each structured data element
+ * the number of parameters followed by their keys and values, all as
+ * NUL terminated strings.
+ */
+static void spool_serialize(struct audit_record *rec, char *buf, size_t len)
+{
+	struct spool_header *hdr = (struct spool_header *)buf;
+	struct jalp_structured_data *sd;
+	struct jalp_param *param;
+	char *pos = buf + sizeof(*hdr);
+	uint32_t count;
+
+	hdr->nsd = 0;
+	pos = spool_put_string(pos, rec->log.message);
+	if (rec->packed) {
+		spool_put_packed(rec, pos);
+		hdr->nsd = rec->packed_nsd;
+		goto out;
+	}
+	for (sd = rec->log.sd; sd; sd = sd->next) {
+		count = 0;
+		for (param = sd->param_list; param; param = param->next) {
+			count++;
+		}
+		memcpy(pos, &count, sizeof(count));
+		pos += sizeof(count);
+		for (param = sd->param_list; param; param = param->next) {
+			pos = spool_put_string(pos, param->key);
+			pos = spool_put_string(pos, param->value);
+		}
+		hdr->nsd++;
+	}
+out:
+	hdr->len = len;
+	hdr->reserved = 0;
+	hdr->enqueued_ns = rec->enqueued_ns;
+	__atomic_store_n(&hdr->state, SPOOL_RECORD_READY, __ATOMIC_RELEASE);
+}
+
+/*
+ * Check that the message and every key and value of a spooled record are
+ * terminated within hdr->len, so that a damaged segment cannot make the
+ * reader run past the record.
+ */
+static int spool_record_valid(const struct spool_header *hdr)
+{
+	const char *pos = (const char *)(hdr + 1);
+	const char *end = (const char *)hdr + hdr->len;
+	uint32_t count;
+	uint32_t i;
+	uint32_t j;
+
+	pos = memchr(pos, '\0', end - pos);
+	if (!pos) {
+		return 0;
+	}
+	pos++;
+	for (i = 0; i < hdr->nsd; i++) {
+		if ((size_t)(end - pos) < sizeof(count)) {
+			return 0;
+		}
+		memcpy(&count, pos, sizeof(count));
+		pos += sizeof(count);
+		// Every key and value takes at least its terminator.
+		if (count > (size_t)(end - pos) / 2) {
+			return 0;
+		}
+		for (j = 0; j < 2 * count; j++) {
+			pos = memchr(pos, '\0', end - pos);
+			if (!pos) {
+				return 0;
+			}
+			pos++;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Rebuild a spooled record. The serialized form is copied into the
+ * record's arena once, and the parameters point into that copy.
+ */
+static struct audit_record *spool_deserialize(struct spool_header *hdr, int replayed)
+{
+	struct audit_record *rec = record_start();
+	struct jalp_structured_data *sd = NULL;
+	struct jalp_param *tail;
+	size_t len = hdr->len - sizeof(*hdr);
+	char *pos;
+	char *key;
+	uint32_t count;
+	uint32_t i;
+	uint32_t j;
+
+	if (!rec) {
+		return NULL;
+	}
+	pos = arena_alloc(rec, len);
+	if (!pos) {
+		goto err;
+	}
+	memcpy(pos, hdr + 1, len);
+	rec->log.message = pos;
+	pos += strlen(pos) + 1;
+	for (i = 0; i < hdr->nsd; i++) {
+		if (!record_add_sd(rec, &sd)) {
+			goto err;
+		}
+		tail = NULL;
+		memcpy(&count, pos, sizeof(count));
+		pos += sizeof(count);
+		for (j = 0; j < count; j++) {
+			key = (char *)intern_key(pos);
+			if (!key) {
+				key = pos;
+			}
+			pos += strlen(pos) + 1;
+			if (record_link_param(rec, &sd->param_list, &tail, key, pos) < 0) {
+				goto err;
+			}
+			pos += strlen(pos) + 1;
+		}
+	}
+	// Monotonic timestamps of an earlier run mean nothing now.
+	rec->enqueued_ns = replayed ? monotonic_ns() : hdr->enqueued_ns;
+	return rec;
+err:
+	record_release(&rec);
+	return NULL;
+}
+
+/*
+ * Append rec to the spool. Returns -1 if the record does not fit in a
+ * segment or spool_max_segments are in use. The caller keeps ownership
+ * of rec either way.
+ */
+static int spool_append(struct audit_record *rec)
+{
+	struct spool_segment *seg = &spool->write;
+	size_t len = spool_record_size(rec);
+	int rc = -1;
+	int cancel_state;
+
+	if (len > (size_t)spool_segment_size) {
+		return -1;
+	}
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+	pthread_mutex_lock(&spool->lock);
+	if (!seg->base || len > seg->size - seg->pos) {
+		if (spool->next_seq - spool->read.seq >= (unsigned long)spool_max_segments) {
+			goto out;
+		}
+		if (seg->base) {
+			spool_segment_close(seg, 0);
+		}
+		if (spool_segment_open(seg, spool->next_seq, 1) < 0) {
+			syslog(LOG_ERR, "failure creating spool segment: %s", strerror(errno));
+			goto out;
+		}
+		spool->next_seq++;
+	}
+	spool_serialize(rec, seg->base + seg->pos, len);
+	seg->pos += len;
+	__atomic_add_fetch(&spool->records, 1, __ATOMIC_RELEASE);
+	rc = 0;
+out:
+	pthread_mutex_unlock(&spool->lock);
+	pthread_setcancelstate(cancel_state, NULL);
+	if (rc == 0) {
+		ring_wake(&event_lanes[LANE_NORMAL]->data_waiters,
+				event_lanes[LANE_NORMAL]->data_fd);
+	}
+	return rc;
+}
+
+/*
+ * Move the read position to the next unconsumed record, removing every
+ * segment that has been read completely. Returns its header, or NULL if
+ * the reader has caught up with the writer.
+ */
+static struct spool_header *spool_advance(void)
+{
+	struct spool_segment *seg = &spool->read;
+	struct spool_header *hdr;
+
+	while (seg->seq < spool->next_seq) {
+		if (!seg->base && spool_segment_open(seg, seg->seq, 0) < 0) {
+			syslog(LOG_ERR, "failure opening spool segment %lu: %s",
+					seg->seq, strerror(errno));
+			seg->seq++;
+			continue;
+		}
+		hdr = spool_segment_header(seg);
+		if (hdr && __atomic_load_n(&hdr->state, __ATOMIC_ACQUIRE) != 0 &&
+				hdr->len >= sizeof(*hdr) && hdr->len <= seg->size - seg->pos) {
+			if (hdr->state == SPOOL_RECORD_READY) {
+				return hdr;
+			}
+			seg->pos += hdr->len;
+			continue;
+		}
+		if (seg->seq == spool->write.seq && spool->write.base) {
+			// The writer may still append to this segment.
+			return NULL;
+		}
+		spool_segment_close(seg, 1);
+		seg->seq++;
+	}
+	return NULL;
+}
+
+/*
+ * Set the read segment aside after a record in it failed validation:
+ * rename it so that it is neither read nor replayed again, forget the
+ * records it still held and move on to the next segment.
+ */
+static void spool_quarantine(void)
+{
+	struct spool_segment *seg = &spool->read;
+	char name[32];
+	char quarantine[48];
+	unsigned long lost;
+
+	lost = spool_segment_ready(seg);
+	spool_segment_name(name, sizeof(name), seg->seq);
+	snprintf(quarantine, sizeof(quarantine), "%s.corrupt", name);
+	syslog(LOG_ERR, "corrupt record in spool segment %s, %lu records lost",
+			name, lost);
+	if (renameat(spool->dir_fd, name, spool->dir_fd, quarantine) < 0) {
+		syslog(LOG_ERR, "failure renaming spool segment %s: %s", name,
+				strerror(errno));
+	}
+	__atomic_sub_fetch(&spool->records, lost, __ATOMIC_RELEASE);
+	if (seg->seq == spool->write.seq && spool->write.base) {
+		// New records go to a fresh segment.
+		spool_segment_close(&spool->write, 0);
+	}
+	spool_segment_close(seg, 0);
+	seg->seq++;
+}
+
+/* Pop the oldest spooled record, or return NULL if there is none. */
+static struct audit_record *spool_pop(void)
+{
+	struct spool_header *hdr;
+	struct audit_record *rec = NULL;
+	int cancel_state;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+	pthread_mutex_lock(&spool->lock);
+	while ((hdr = spool_advance()) && !spool_record_valid(hdr)) {
+		spool_quarantine();
+	}
+	if (hdr) {
+		rec = spool_deserialize(hdr, spool->read.seq < spool->first_seq);
+		if (rec) {
+			__atomic_store_n(&hdr->state, SPOOL_RECORD_DONE, __ATOMIC_RELAXED);
+			spool->read.pos += hdr->len;
+			__atomic_sub_fetch(&spool->records, 1, __ATOMIC_RELEASE);
+			spool_advance();
+		} else {
+			syslog(LOG_ERR, "failure allocating spooled record");
+		}
+	}
+	pthread_mutex_unlock(&spool->lock);
+	pthread_setcancelstate(cancel_state, NULL);
+	return rec;
+}
+
+/*
+ * Write recs to new segments placed before the read segment, so that they
+ * are read ahead of everything already spooled. Only used while no
+ * sender is running. Records written are released and their entries set
+ * to NULL; the caller keeps the others. Returns the number written.
+ */
+static unsigned long spool_prepend(struct audit_record **recs, unsigned long count)
+{
+	struct spool_segment seg = { 0, -1, NULL, 0, 0 };
+	unsigned long segments = 1;
+	unsigned long seq;
+	unsigned long written = 0;
+	unsigned long i;
+	size_t used = 0;
+	size_t len;
+
+	for (i = 0; i < count; i++) {
+		len = spool_record_size(recs[i]);
+		if (len > (size_t)spool_segment_size) {
+			continue;
+		}
+		if (used + len > (size_t)spool_segment_size) {
+			segments++;
+			used = 0;
+		}
+		used += len;
+	}
+	// An old spool without room below it gets the records at its end.
+	if (spool->read.seq >= segments) {
+		seq = spool->read.seq - segments;
+		// Records already read from the current segment are marked
+		// done, so it can simply be read again from the start.
+		spool_segment_close(&spool->read, 0);
+		spool->read.seq = seq;
+	} else {
+		seq = spool->next_seq;
+	}
+
+	for (i = 0; i < count; i++) {
+		len = spool_record_size(recs[i]);
+		if (len > (size_t)spool_segment_size) {
+			continue;
+		}
+		if (!seg.base || len > seg.size - seg.pos) {
+			spool_segment_close(&seg, 0);
+			if (spool_segment_open(&seg, seq, 1) < 0) {
+				syslog(LOG_ERR, "failure creating spool segment: %s", strerror(errno));
+				break;
+			}
+			if (seq == spool->next_seq) {
+				spool->next_seq++;
+			}
+			seq++;
+		}
+		spool_serialize(recs[i], seg.base + seg.pos, len);
+		seg.pos += len;
+		record_release(&recs[i]);
+		written++;
+	}
+	spool_segment_close(&seg, 0);
+	spool->records += written;
+	return written;
+}
+
+static size_t record_size(struct audit_record *rec)
+{
+	return sizeof(*rec) + rec->bytes;
+}
+
+/* Records waiting in all lanes. */
+static unsigned long queue_length(void)
+{
+	unsigned long len = 0;
+	int lane;
+
+	for (lane = 0; lane < LANE_COUNT; lane++) {
+		len += ring_length(event_lanes[lane]);
+	}
+	return len;
+}
+
+/*
+ * Byte limit of a lane. High priority records may always use the memory
+ * held by the other lanes, while low priority ones give way to them from
+ * the high watermark on.
+ */
+static unsigned long lane_limit(int lane)
+{
+	if (lane == LANE_HIGH) {
+		return 0;
+	}
+	if (lane == LANE_LOW) {
+		return (unsigned long)queue_max_bytes * queue_high_watermark / 100;
+	}
+	return queue_max_bytes;
+}
+
+/*
+ * Push rec onto the event queue unless that takes the queued bytes past
+ * limit (0 for no limit). A record larger than the limit still fits
+ * into an empty queue. Returns 0 on success and -1 if there is no room.
+ */
+static int queue_try_push(struct ring *r, struct audit_record *rec, unsigned long limit)
+{
+	size_t size = record_size(rec);
+	unsigned long used;
+
+	// Account before pushing, so a sender popping the record at once
+	// never takes the total below zero.
+	used = __atomic_add_fetch(&queue_bytes, size, __ATOMIC_RELAXED);
+	if ((limit > 0 && used > limit && used != size) || ring_try_push(r, rec) < 0) {
+		__atomic_sub_fetch(&queue_bytes, size, __ATOMIC_RELAXED);
+		return -1;
+	}
+	__atomic_store_n(&queue_max_bytes_seen,
+			MAX(used, queue_max_bytes_seen), __ATOMIC_RELAXED);
+	if (r != event_lanes[LANE_NORMAL]) {
+		ring_wake(&event_lanes[LANE_NORMAL]->data_waiters,
+				event_lanes[LANE_NORMAL]->data_fd);
+	}
+	return 0;
+}
+
+static struct audit_record *queue_try_pop(struct ring *r)
+{
+	struct audit_record *rec = ring_try_pop(r);
+
+	if (rec) {
+		__atomic_sub_fetch(&queue_bytes, record_size(rec), __ATOMIC_RELAXED);
+		// ring_try_pop() woke a parser waiting for space before the
+		// bytes were given back, so it may have gone to sleep again.
+		if (queue_max_bytes > 0) {
+			ring_wake(&r->space_waiters, r->space_fd);
+		}
+	}
+	return rec;
+}
+
+/* Push check for a lane, honouring its byte limit. */
+static int queue_check_space(struct ring *r, void **out)
+{
+	struct audit_record *rec = *out;
+
+	return queue_try_push(r, rec, lane_limit(rec->lane)) == 0;
+}
+
+/*
+ * Pop check for the event queue. Out of every sum-of-weights pops, each
+ * sender gives each lane as many turns as its weight; the turn of an
+ * empty lane passes on to the next one. The spool holds normal records
+ * and is read once the normal lane is empty.
+ */
+static int queue_check_data(struct ring *r, void **out)
+{
+	// The weights may change under us on reload.
+	unsigned int high = __atomic_load_n(&lane_weights[LANE_HIGH], __ATOMIC_RELAXED);
+	unsigned int normal = __atomic_load_n(&lane_weights[LANE_NORMAL], __ATOMIC_RELAXED);
+	unsigned int low = __atomic_load_n(&lane_weights[LANE_LOW], __ATOMIC_RELAXED);
+	unsigned int turn;
+	int first;
+	int lane;
+	int i;
+
+	UNUSED(r);
+	turn = lane_turn++ % MAX(high + normal + low, 1U);
+	if (turn < high) {
+		first = LANE_HIGH;
+	} else if (turn < high + normal) {
+		first = LANE_NORMAL;
+	} else {
+		first = LANE_LOW;
+	}
+	for (i = 0; i < LANE_COUNT; i++) {
+		lane = (first + i) % LANE_COUNT;
+		*out = queue_try_pop(event_lanes[lane]);
+		if (!*out && lane == LANE_NORMAL && spool_pending()) {
+			*out = spool_pop();
+		}
+		if (*out) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Fill level of the event queue in percent of whichever of its limits
+ * is closer: the length of the normal lane or the bytes of all lanes.
+ */
+static unsigned long queue_fill(void)
+{
+	unsigned long fill = ring_length(event_lanes[LANE_NORMAL]) * 100 /
+			event_lanes[LANE_NORMAL]->capacity;
+
+	if (queue_max_bytes > 0) {
+		fill = MAX(fill, __atomic_load_n(&queue_bytes, __ATOMIC_RELAXED) * 100 /
+				(unsigned long)queue_max_bytes);
+	}
+	return fill;
+}
+
+/*
+ * Update the congestion state from the fill level and return it. Only
+ * parsers call this.
+ */
+static int queue_congestion(void)
+{
+	unsigned long fill = queue_fill();
+	int was_congested = __atomic_load_n(&queue_congested, __ATOMIC_RELAXED);
+	int congested = was_congested;
+
+	if (fill >= (unsigned long)queue_high_watermark) {
+		congested = 1;
+	} else if (fill <= (unsigned long)queue_low_watermark) {
+		congested = 0;
+	}
+	if (congested != was_congested) {
+		__atomic_store_n(&queue_congested, congested, __ATOMIC_RELAXED);
+	}
+	return congested;
+}
+
+/*
+ * Is the current record an EOE marker (SKIP_EOE), of a filtered type
+ * (SKIP_FILTERED) or of a type shed while the queue is congested
+ * (SKIP_SHED)?
+ */
+static int record_skipped(auparse_state_t *au)
+{
+	int type = auparse_get_type(au);
+
+	if (type == AUDIT_EOE) {
+		return SKIP_EOE;
+	}
+	if (type <= 0 || type >= AUDIT_TYPE_MAX) {
+		return drop_unlisted_types ? SKIP_FILTERED : SKIP_NONE;
+	}
+	if (TYPE_BIT_TEST(dropped_types, type)) {
+		return SKIP_FILTERED;
+	}
+	if (event_shed && TYPE_BIT_TEST(shed_types, type)) {
+		return SKIP_SHED;
+	}
+	return SKIP_NONE;
+}
+
+/* Lane for records of type. */
+static int record_lane(int type)
+{
+	if (type <= 0 || type >= AUDIT_TYPE_MAX) {
+		return LANE_NORMAL;
+	}
+	if (TYPE_BIT_TEST(high_priority_types, type)) {
+		return LANE_HIGH;
+	}
+	if (TYPE_BIT_TEST(low_priority_types, type)) {
+		return LANE_LOW;
+	}
+	return LANE_NORMAL;
+}
+
+/* record_skipped() for the conversion loops, which also count records. */
+static int record_skipped_count(auparse_state_t *au)
+{
+	int skip = record_skipped(au);
+
+	if (skip != SKIP_EOE) {
+		STAT_INC(records_parsed);
+	}
+	if (skip == SKIP_FILTERED) {
+		STAT_INC(records_filtered);
+	}
+	if (skip == SKIP_SHED) {
+		STAT_INC(records_shed);
+	}
+	return skip;
+}
+
+/* Does key, in a record of type, match the field filters of table? */
+static int field_listed(GHashTable *table, const char *key, int type)
+{
+	struct field_filter *filter;
+
+	filter = g_hash_table_lookup(table, key);
+	if (!filter) {
+		return 0;
+	}
+	if (filter->any_type) {
+		return 1;
+	}
+	return type > 0 && type < AUDIT_TYPE_MAX && TYPE_BIT_TEST(filter->types, type);
+}
+
+static int field_skipped(const char *key, int type)
+{
+	return field_listed(excluded_fields, key, type);
+}
+
+/*
+ * Does any rule key of the event match exclude_keys? Events matching
+ * several rules carry all of their keys separated by \001.
+ */
+static int event_skipped(auparse_state_t *au)
+{
+	const char *value;
+	char keys[MAX_AUDIT_MESSAGE_LENGTH];
+	char *key;
+	char *save = NULL;
+	size_t len;
+	int skip = 0;
+
+	if (!excluded_keys || g_hash_table_size(excluded_keys) == 0) {
+		return 0;
+	}
+
+	auparse_first_record(au);
+	if (auparse_find_field(au, "key")) {
+		value = auparse_get_field_str(au);
+		len = strlen(value);
+		if (len >= 2 && value[0] == '"' && value[len - 1] == '"') {
+			value++;
+			len -= 2;
+		}
+		if (len < sizeof(keys)) {
+			memcpy(keys, value, len);
+			keys[len] = '\0';
+			for (key = strtok_r(keys, "\001", &save); key && !skip;
+					key = strtok_r(NULL, "\001", &save)) {
+				skip = g_hash_table_lookup(excluded_keys, key) != NULL;
+			}
+		}
+	}
+	auparse_first_record(au);
+	return skip;
+}
+
+/*
+ * Append auparse's interpretation of the current field, named key, after
+ * *tail as a parameter named in upper case.
+ */
+static int record_add_interpreted(auparse_state_t *au, struct audit_record *rec,
+		struct jalp_param **head, struct jalp_param **tail, const char *key)
+{
+	const char *value;
+	char *key_copy;
+	char *value_copy;
+	char *pos;
+
+	pthread_mutex_lock(&interpret_lock);
+	value = auparse_interpret_field(au);
+	value_copy = value ? arena_strdup(rec, value) : NULL;
+	pthread_mutex_unlock(&interpret_lock);
+	if (!value) {
+		return 0;
+	}
+	key_copy = arena_strdup(rec, key);
+	if (!key_copy || !value_copy) {
+		return -1;
+	}
+	for (pos = key_copy; *pos; pos++) {
+		*pos = toupper((unsigned char)*pos);
+	}
+	return record_link_param(rec, head, tail, key_copy, value_copy);
+}
+
+#ifdef RECORD_LAYOUTS
+/*
+ * The key of the next field of layout from *next on that is key, and
+ * advance *next past it, or NULL if there is none.
+ */
+static const char *layout_key(const struct record_layout *layout, unsigned int *next,
+		const char *key)
+{
+	unsigned int i;
+
+	for (i = *next; i < layout->count; i++) {
+		if (strcmp(layout->fields[i], key) == 0) {
+			*next = i + 1;
+			return layout->fields[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * record_add_fields() for a record with a layout: keys come from the
+ * layout and the parameters of every field are allocated at once.
+ */
+static int record_add_layout_fields(auparse_state_t *au, struct audit_record *rec,
+		struct jalp_param **params, const struct record_layout *layout)
+{
+	struct jalp_param *tail = NULL;
+	struct jalp_param *param;
+	unsigned int left = auparse_get_num_fields(au);
+	unsigned int next = 0;
+	int type = auparse_get_type(au);
+	int filter_fields = excluded_fields && g_hash_table_size(excluded_fields) > 0;
+	int interpret = interpreted_fields && g_hash_table_size(interpreted_fields) > 0;
+
+	*params = NULL;
+	param = arena_alloc(rec, left * sizeof(*param));
+	if (!param) {
+		syslog(LOG_ERR, "failure allocating JALP parameters");
+		return -1;
+	}
+	do {
+		const char *key = auparse_get_field_name(au);
+		const char *value = auparse_get_field_str(au);
+
+		if (filter_fields && field_skipped(key, type)) {
+			continue;
+		}
+
+		if (left == 0) {
+			// More fields than auparse counted; not expected.
+			if (record_add_param(rec, params, &tail, key, value) < 0) {
+				syslog(LOG_ERR, "failure appending JALP parameter: %s %s", key, value);
+				return -1;
+			}
+		} else {
+			param->key = (char *)layout_key(layout, &next, key);
+			if (!param->key) {
+				param->key = (char *)intern_key(key);
+			}
+			if (!param->key) {
+				param->key = arena_strdup(rec, key);
+			}
+			param->value = arena_strdup(rec, value);
+			if (!param->key || !param->value) {
+				syslog(LOG_ERR, "failure appending JALP parameter: %s %s", key, value);
+				return -1;
+			}
+			param->next = NULL;
+			if (tail) {
+				tail->next = param;
+			} else {
+				*params = param;
+			}
+			tail = param++;
+			left--;
+		}
+
+		if (interpret && field_listed(interpreted_fields, key, type) &&
+				record_add_interpreted(au, rec, params, &tail, key) < 0) {
+			syslog(LOG_ERR, "failure appending interpreted JALP parameter: %s", key);
+			return -1;
+		}
+	} while (auparse_next_field(au) > 0);
+	return 0;
+}
+#endif
+
+/*
+ * Convert the fields of the current auparse record into a parameter list.
+ * Returns 0 on success and -1 on failure.
+ */
+static int record_add_fields(auparse_state_t *au, struct audit_record *rec,
+		struct jalp_param **params)
+{
+	struct jalp_param *tail = NULL;
+	int type = auparse_get_type(au);
+	int filter_fields = excluded_fields && g_hash_table_size(excluded_fields) > 0;
+	int interpret = interpreted_fields && g_hash_table_size(interpreted_fields) > 0;
+#ifdef RECORD_LAYOUTS
+	const struct record_layout *layout = record_layout_find(type);
+
+	if (layout) {
+		return record_add_layout_fields(au, rec, params, layout);
+	}
+#endif
+
+	*params = NULL;
+	do {
+		const char *key = auparse_get_field_name(au);
+		const char *value = auparse_get_field_str(au);
+
+		if (filter_fields && field_skipped(key, type)) {
+			continue;
+		}
+
+		if (record_add_param(rec, params, &tail, key, value) < 0) {
+			syslog(LOG_ERR, "failure appending JALP parameter: %s %s", key, value);
+			return -1;
+		}
+		if (interpret && field_listed(interpreted_fields, key, type) &&
+				record_add_interpreted(au, rec, params, &tail, key) < 0) {
+			syslog(LOG_ERR, "failure appending interpreted JALP parameter: %s", key);
+			return -1;
+		}
+	} while (auparse_next_field(au) > 0);
+	return 0;
+}
+
+/* Join the text of every record in the event, one record per line. */
+static char *record_event_text(auparse_state_t *au, struct audit_record *rec)
+{
+	size_t len = 0;
+	size_t n;
+	char *text;
+	char *pos;
+
+	auparse_first_record(au);
+	do {
+		if (!record_skipped(au)) {
+			len += strlen(auparse_get_record_text(au)) + 1;
+		}
+	} while (auparse_next_record(au) > 0);
+
+	text = arena_alloc(rec, len + 1);
+	if (!text) {
+		return NULL;
+	}
+	pos = text;
+	auparse_first_record(au);
+	do {
+		if (!record_skipped(au)) {
+			if (pos != text) {
+				*pos++ = '\n';
+			}
+			n = strlen(auparse_get_record_text(au));
+			memcpy(pos, auparse_get_record_text(au), n);
+			pos += n;
+		}
+	} while (auparse_next_record(au) > 0);
+	*pos = '\0';
+	return text;
+}
+
+/*
+ * Find "key=value" in text from *cursor on, and advance *cursor past
+ * it. auparse reports fields in the order of the text, so the search
+ * normally ends right away. Returns the offset of the key or -1.
+ */
+static long field_locate(const char *text, size_t text_len, size_t *cursor,
+		const char *key, size_t key_len, const char *value, size_t value_len)
+{
+	const char *end = text + text_len;
+	const char *pos = text + *cursor;
+
+	while ((pos = memmem(pos, end - pos, key, key_len))) {
+		if ((size_t)(end - pos) > key_len + value_len && pos[key_len] == '=' &&
+				memcmp(pos + key_len + 1, value, value_len) == 0) {
+			*cursor = pos - text + key_len + 1 + value_len;
+			return pos - text;
+		}
+		pos++;
+	}
+	return -1;
+}
+
+/*
+ * Where record_pack_fields() puts the next index entry and the next
+ * copied field. While buf is NULL it only measures.
+ */
+struct packer {
+	char *buf;
+	size_t index;
+	size_t extra;
+};
+
+/*
+ * Index the fields of the current record, whose text starts at offset
+ * base of the packed form. Returns 0 on success and -1 if a field is
+ * too long to be indexed.
+ */
+static int record_pack_fields(auparse_state_t *au, struct packer *p, size_t base)
+{
+	const char *text = auparse_get_record_text(au);
+	size_t text_len = strlen(text);
+	int type = auparse_get_type(au);
+	int filter_fields = excluded_fields && g_hash_table_size(excluded_fields) > 0;
+	struct packed_field field;
+	size_t count_pos = p->index;
+	size_t cursor = 0;
+	size_t key_len;
+	size_t value_len;
+	uint32_t count = 0;
+	long offset;
+
+	p->index += sizeof(count);
+	auparse_first_field(au);
+	do {
+		const char *key = auparse_get_field_name(au);
+		const char *value = auparse_get_field_str(au);
+
+		if (filter_fields && field_skipped(key, type)) {
+			continue;
+		}
+		key_len = strlen(key);
+		value_len = strlen(value);
+		if (key_len > UINT16_MAX || value_len > UINT16_MAX) {
+			return -1;
+		}
+		offset = field_locate(text, text_len, &cursor, key, key_len, value, value_len);
+		if (offset >= 0) {
+			field.key = base + offset;
+			field.value = field.key + key_len + 1;
+		} else {
+			field.key = p->extra;
+			field.value = p->extra + key_len;
+			if (p->buf) {
+				memcpy(p->buf + field.key, key, key_len);
+				memcpy(p->buf + field.value, value, value_len);
+			}
+			p->extra += key_len + value_len;
+		}
+		field.key_len = key_len;
+		field.value_len = value_len;
+		if (p->buf) {
+			memcpy(p->buf + p->index, &field, sizeof(field));
+		}
+		p->index += sizeof(field);
+		count++;
+	} while (auparse_next_field(au) > 0);
+	if (p->buf) {
+		memcpy(p->buf + count_pos, &count, sizeof(count));
+	}
+	return 0;
+}
+
+/*
+ * Allocate the packed form of rec once the first pass measured it, and
+ * set up the second pass.
+ */
+static int record_pack_alloc(struct audit_record *rec, struct packer *p,
+		size_t text_len, uint32_t nsd)
+{
+	size_t index = PACKED_ALIGN(text_len);
+
+	p->buf = arena_alloc(rec, p->index + p->extra);
+	if (!p->buf) {
+		return -1;
+	}
+	p->extra = p->index;
+	p->index = index;
+	rec->packed = p->buf;
+	rec->packed_index = index;
+	rec->packed_nsd = nsd;
+	rec->log.message = p->buf;
+	return 0;
+}
+
+/* Pack the text and fields of the current record into rec. */
+static int record_pack(auparse_state_t *au, struct audit_record *rec)
+{
+	const char *text = auparse_get_record_text(au);
+	size_t text_len = strlen(text) + 1;
+	struct packer p = { NULL, PACKED_ALIGN(text_len), 0 };
+
+	if (record_pack_fields(au, &p, 0) < 0 ||
+			record_pack_alloc(rec, &p, text_len, 1) < 0) {
+		return -1;
+	}
+	memcpy(p.buf, text, text_len);
+	return record_pack_fields(au, &p, 0);
+}
+
+/*
+ * Pack every record of the event that is not skipped into rec: their
+ * text joined by newlines as in record_event_text(), then the fields of
+ * each record.
+ */
+static int record_pack_event(auparse_state_t *au, struct audit_record *rec)
+{
+	struct packer p = { NULL, 0, 0 };
+	size_t text_len = 0;
+	size_t pos = 0;
+	size_t n;
+	uint32_t nsd = 0;
+
+	auparse_first_record(au);
+	do {
+		if (!record_skipped(au)) {
+			text_len += strlen(auparse_get_record_text(au)) + 1;
+			nsd++;
+		}
+	} while (auparse_next_record(au) > 0);
+
+	p.index = PACKED_ALIGN(text_len);
+	auparse_first_record(au);
+	do {
+		if (!record_skipped(au)) {
+			if (record_pack_fields(au, &p, 0) < 0) {
+				return -1;
+			}
+		}
+	} while (auparse_next_record(au) > 0);
+	if (record_pack_alloc(rec, &p, text_len, nsd) < 0) {
+		return -1;
+	}
+
+	auparse_first_record(au);
+	do {
+		if (!record_skipped(au)) {
+			if (pos > 0) {
+				p.buf[pos - 1] = '\n';
+			}
+			n = strlen(auparse_get_record_text(au)) + 1;
+			memcpy(p.buf + pos, auparse_get_record_text(au), n);
+			if (record_pack_fields(au, &p, pos) < 0) {
+				return -1;
+			}
+			pos += n;
+		}
+	} while (auparse_next_record(au) > 0);
+	return 0;
+}
+
+static int status_get(void)
+{
+	return __atomic_load_n(&status, __ATOMIC_SEQ_CST);
+}
+
+/* Ask the main loop to STOP or RELOAD and wake it up. */
+static void status_request(int new_status)
+{
+	uint64_t one = 1;
+	int old = RUN;
+
+	if (new_status == STOP) {
+		__atomic_store_n(&status, STOP, __ATOMIC_SEQ_CST);
+	} else if (!__atomic_compare_exchange_n(&status, &old, new_status, 0,
+				__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		// Already reloading or stopping
+		return;
+	}
+	if (wake_fd >= 0 && write(wake_fd, &one, sizeof(one)) < 0) {
+		syslog(LOG_ERR, "failure waking main loop: %s", strerror(errno));
+	}
+}
+
+/*
+ * Act on the signals waiting on signal_fd. Any thread may, as SIGHUP
+ * and SIGTERM are blocked in all of them.
+ */
+static void input_signals(void)
+{
+	struct signalfd_siginfo info;
+
+	while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+		status_request(info.ssi_signo == SIGTERM ? STOP : RELOAD);
+	}
+}
+
+/*
+ * Drop a queued record to make room for one of lane: the oldest of the
+ * lane itself or, with drop_lowest_priority and only the byte limit in
+ * the way, the oldest of the lowest priority lane below it that holds
+ * any. Returns -1 if there was nothing to drop.
+ */
+static int queue_evict(int lane)
+{
+	struct ring *r = event_lanes[lane];
+	struct audit_record *old = NULL;
+	int i;
+
+	if (overload_policy == OVERLOAD_DROP_LOWEST && ring_length(r) < r->capacity) {
+		for (i = LANE_LOW; i > lane && !old; i--) {
+			old = queue_try_pop(event_lanes[i]);
+		}
+	}
+	if (!old) {
+		old = queue_try_pop(r);
+	}
+	if (!old) {
+		return -1;
+	}
+	STAT_INC(records_dropped);
+	record_discard(&old);
+	return 0;
+}
+
+/*
+ * Push rec into its lane, applying overload_policy if there is no room.
+ * Returns -1 if it did not make it in.
+ */
+static int queue_overload_push(struct audit_record *rec)
+{
+	struct ring *r = event_lanes[rec->lane];
+	int i;
+
+	if (replay) {
+		// Wait as long as it takes, but not past a SIGTERM, which
+		// nobody else may be reading while this thread waits.
+		while (ring_push(r, rec, 1, queue_check_space) < 0) {
+			input_signals();
+			if (status_get() == STOP) {
+				return -1;
+			}
+		}
+		return 0;
+	}
+	if (overload_policy == OVERLOAD_BLOCK || overload_policy == OVERLOAD_SPILL) {
+		return ring_push(r, rec, overload_timeout, queue_check_space);
+	}
+	for (i = 0; i < OVERLOAD_EVICT_MAX; i++) {
+		if (queue_try_push(r, rec, lane_limit(rec->lane)) == 0) {
+			return 0;
+		}
+		if (overload_policy == OVERLOAD_DROP_NEWEST || queue_evict(rec->lane) < 0) {
+			break;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Queue rec for the senders in its lane. Low priority records are
+ * dropped at once if the queue is congested, and if their lane is full
+ * unless overload_policy drops older records instead. With spill, a full
+ * high priority lane or a congested queue spills to disk, and only once
+ * the spool is full as well does the parser wait for space. A replay
+ * always waits. The record is released if it is spilled or discarded.
+ * Returns -1 if it was discarded.
+ */
+static int record_enqueue(struct audit_record **rec)
+{
+	long long start = monotonic_ns();
+	int lane = (*rec)->lane;
+	struct ring *r = event_lanes[lane];
+	int rc = -1;
+
+	(*rec)->enqueued_ns = start;
+	if (lane == LANE_LOW && !replay) {
+		if (!queue_congestion()) {
+			rc = overload_policy == OVERLOAD_BLOCK ||
+				overload_policy == OVERLOAD_SPILL ?
+				queue_try_push(r, *rec, lane_limit(lane)) :
+				queue_overload_push(*rec);
+		}
+		if (rc < 0) {
+			STAT_INC(records_dropped);
+			record_discard(rec);
+			return -1;
+		}
+	} else if (spool && overload_policy == OVERLOAD_SPILL && !replay) {
+		if (lane == LANE_HIGH) {
+			rc = queue_try_push(r, *rec, lane_limit(lane));
+		} else if (!spool_pending() && !queue_congestion()) {
+			rc = queue_try_push(r, *rec, lane_limit(lane));
+		}
+		if (rc < 0 && spool_append(*rec) == 0) {
+			hist_record(&my_stats->enqueue_wait, monotonic_ns() - start);
+			STAT_INC(records_spilled);
+			record_release(rec);
+			return 0;
+		}
+	}
+	if (rc < 0) {
+		rc = queue_overload_push(*rec);
+	}
+	hist_record(&my_stats->enqueue_wait, monotonic_ns() - start);
+	if (rc < 0) {
+		// The queue is still full. Discard message
+		STAT_INC(records_dropped);
+		record_discard(rec);
+		return -1;
+	}
+	STAT_INC(records_enqueued);
+
+	__atomic_store_n(&queue_max_length_seen,
+			MAX(queue_length(), __atomic_load_n(&queue_max_length_seen,
+			__ATOMIC_RELAXED)), __ATOMIC_RELAXED);
+	*rec = NULL;
+	return 0;
+}
+
+/*
+ * Give a record taken from the queue but not sent back to the senders,
+ * through the spool if its lane is full. The record is released if
+ * neither has room.
+ */
+static int record_requeue(struct audit_record **rec)
+{
+	if (queue_try_push(event_lanes[(*rec)->lane], *rec, 0) == 0) {
+		*rec = NULL;
+		return 0;
+	}
+	if (spool && spool_append(*rec) == 0) {
+		record_release(rec);
+		return 0;
+	}
+	record_discard(rec);
+	return -1;
+}
+
+/* Queue a converted record, or hold it if event_hold is set. */
+static int record_emit(struct audit_record **rec)
+{
+	if (event_hold) {
+		*event_hold = *rec;
+		event_hold = &(*rec)->next;
+		*rec = NULL;
+		return 0;
+	}
+	return record_enqueue(rec);
+}
+
+static void coalesce_entry_free(void *ptr)
+{
+	struct coalesce_entry *entry = ptr;
+	struct audit_record *rec;
+
+	while ((rec = entry->held)) {
+		entry->held = rec->next;
+		record_release(&rec);
+	}
+	free(entry);
+}
+
+static struct coalescer *coalesce_create(void)
+{
+	struct coalescer *c = calloc(1, sizeof(*c));
+
+	if (!c) {
+		return NULL;
+	}
+	c->entries = g_hash_table_new_full(g_str_hash, g_str_equal, free,
+			coalesce_entry_free);
+	if (!c->entries) {
+		free(c);
+		return NULL;
+	}
+	return c;
+}
+
+static void coalesce_destroy(struct coalescer **c)
+{
+	if (!c || !*c) {
+		return;
+	}
+	g_hash_table_destroy((*c)->entries);
+	free(*c);
+	*c = NULL;
+}
+
+static int coalesce_pending(struct coalescer *c)
+{
+	return c && g_hash_table_size(c->entries) > 0;
+}
+
+/* Queue the held records of entry, summarizing the repeats in the first. */
+static void coalesce_emit(struct coalesce_entry *entry)
+{
+	struct audit_record *rec = entry->held;
+	struct jalp_param *tail;
+	char count[32];
+
+	if (!rec) {
+		return;
+	}
+	if (rec->packed && record_unpack(rec) < 0) {
+		syslog(LOG_ERR, "failure unpacking coalesced audit record");
+		return;
+	}
+	for (tail = rec->sd.param_list; tail && tail->next; tail = tail->next) {
+		;
+	}
+	snprintf(count, sizeof(count), "%lu", entry->repeats);
+	if (record_add_param(rec, &rec->sd.param_list, &tail, "repeat_count", count) < 0 ||
+			record_add_param(rec, &rec->sd.param_list, &tail, "first_time",
+				entry->first_time) < 0 ||
+			record_add_param(rec, &rec->sd.param_list, &tail, "last_time",
+				entry->last_time) < 0) {
+		syslog(LOG_ERR, "failure appending JALP coalescing parameters");
+		return;
+	}
+	while ((rec = entry->held)) {
+		entry->held = rec->next;
+		rec->next = NULL;
+		record_enqueue(&rec);
+	}
+}
+
+static gboolean coalesce_expired(gpointer key, gpointer value, gpointer data)
+{
+	struct coalesce_entry *entry = value;
+	long long now_ms = *(long long *)data;
+
+	UNUSED(key);
+	if (entry->window_end_ms > now_ms) {
+		return FALSE;
+	}
+	coalesce_emit(entry);
+	return TRUE;
+}
+
+/* Close the windows that ended by now, or every window if all is set. */
+static void coalesce_expire(struct coalescer *c, int all)
+{
+	long long now_ms = all ? LLONG_MAX : monotonic_ms();
+
+	if (coalesce_pending(c)) {
+		g_hash_table_foreach_remove(c->entries, coalesce_expired, &now_ms);
+	}
+}
+
+/*
+ * Join the values of the count fields in the event into key. Returns the
+ * number of fields found, or -1 if the key does not fit.
+ */
+static int event_key(auparse_state_t *au, char **fields, int count,
+		char *key, size_t size)
+{
+	const char *value;
+	size_t len = 0;
+	size_t n;
+	int found = 0;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		auparse_first_record(au);
+		value = auparse_find_field(au, fields[i]);
+		if (value) {
+			found++;
+		} else {
+			value = "";
+		}
+		n = strlen(value);
+		if (len + n + 1 >= size) {
+			return -1;
+		}
+		memcpy(key + len, value, n);
+		len += n;
+		key[len++] = '\037';
+	}
+	key[len] = '\0';
+	auparse_first_record(au);
+	return found;
+}
+
+/*
+ * Look the event up in c. Returns COALESCE_PASS if it is to be sent as
+ * usual, COALESCE_HOLD if it is to be held in *hold, or COALESCE_DROP if
+ * it was counted as a repeat.
+ */
+static int coalesce_event(struct coalescer *c, auparse_state_t *au,
+		struct coalesce_entry **hold)
+{
+	char key[EVENT_KEY_MAX];
+	struct coalesce_entry *entry;
+	const au_event_t *ts;
+	long long now_ms;
+
+	if (!c || coalesce_field_count == 0 || event_key(au, coalesce_fields,
+			coalesce_field_count, key, sizeof(key)) <= 0) {
+		return COALESCE_PASS;
+	}
+	now_ms = monotonic_ms();
+	entry = g_hash_table_lookup(c->entries, key);
+	if (entry && entry->window_end_ms <= now_ms) {
+		coalesce_emit(entry);
+		g_hash_table_remove(c->entries, key);
+		entry = NULL;
+	}
+	if (!entry) {
+		if (g_hash_table_size(c->entries) >= (guint)coalesce_max_entries) {
+			coalesce_expire(c, 0);
+		}
+		if (g_hash_table_size(c->entries) >= (guint)coalesce_max_entries) {
+			return COALESCE_PASS;
+		}
+		entry = calloc(1, sizeof(*entry));
+		if (!entry) {
+			return COALESCE_PASS;
+		}
+		entry->window_end_ms = now_ms + coalesce_window_ms;
+		g_hash_table_insert(c->entries, strdup(key), entry);
+		return COALESCE_PASS;
+	}
+
+	ts = auparse_get_timestamp(au);
+	snprintf(entry->last_time, sizeof(entry->last_time), "%ld.%03u",
+			(long)ts->sec, ts->milli);
+	if (entry->repeats++ == 0) {
+		memcpy(entry->first_time, entry->last_time, sizeof(entry->first_time));
+		*hold = entry;
+		return COALESCE_HOLD;
+	}
+	STAT_INC(events_coalesced);
+	return COALESCE_DROP;
+}
+
+static struct limiter *limiter_create(void)
+{
+	struct limiter *l = calloc(1, sizeof(*l));
+
+	if (!l) {
+		return NULL;
+	}
+	l->buckets = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+	if (!l->buckets) {
+		free(l);
+		return NULL;
+	}
+	return l;
+}
+
+static void limiter_destroy(struct limiter **l)
+{
+	if (!l || !*l) {
+		return;
+	}
+	g_hash_table_destroy((*l)->buckets);
+	free(*l);
+	*l = NULL;
+}
+
+struct limiter_refill {
+	long long now_ms;
+	double rate;
+	double burst;
+};
+
+static gboolean limiter_full(gpointer key, gpointer value, gpointer data)
+{
+	struct rate_bucket *bucket = value;
+	struct limiter_refill *refill = data;
+
+	UNUSED(key);
+	return bucket->tokens + (refill->now_ms - bucket->refill_ms) * refill->rate >=
+		refill->burst;
+}
+
+/* Take a token for the event's source. Returns 1 if there is none. */
+static int limit_event(struct limiter *l, auparse_state_t *au)
+{
+	char key[EVENT_KEY_MAX];
+	struct rate_bucket *bucket;
+	struct limiter_refill refill;
+	int share = num_parsers > 0 ? num_parsers : 1;
+
+	if (!l || rate_limit == 0 || event_key(au, rate_limit_fields,
+			rate_limit_field_count, key, sizeof(key)) < 0) {
+		return 0;
+	}
+	refill.now_ms = monotonic_ms();
+	refill.rate = (double)rate_limit / share / 1000;
+	refill.burst = (double)(rate_limit_burst > 0 ? rate_limit_burst : rate_limit) / share;
+	if (refill.burst < 1) {
+		refill.burst = 1;
+	}
+
+	bucket = g_hash_table_lookup(l->buckets, key);
+	if (!bucket) {
+		// Buckets that have filled up again are as good as new.
+		if (g_hash_table_size(l->buckets) >= (guint)rate_limit_max_sources) {
+			g_hash_table_foreach_remove(l->buckets, limiter_full, &refill);
+		}
+		if (g_hash_table_size(l->buckets) >= (guint)rate_limit_max_sources) {
+			return 0;
+		}
+		bucket = calloc(1, sizeof(*bucket));
+		if (!bucket) {
+			return 0;
+		}
+		bucket->refill_ms = refill.now_ms;
+		bucket->tokens = refill.burst;
+		g_hash_table_insert(l->buckets, strdup(key), bucket);
+	}
+
+	bucket->tokens += (refill.now_ms - bucket->refill_ms) * refill.rate;
+	if (bucket->tokens > refill.burst) {
+		bucket->tokens = refill.burst;
+	}
+	bucket->refill_ms = refill.now_ms;
+	if (bucket->tokens < 1) {
+		return 1;
+	}
+	bucket->tokens -= 1;
+	return 0;
+}
+
+static int event_tables_create(struct event_tables *t)
+{
+	t->coalescer = coalesce_create();
+	t->limiter = limiter_create();
+	return t->coalescer && t->limiter ? 0 : -1;
+}
+
+static void event_tables_destroy(struct event_tables *t)
+{
+	coalesce_destroy(&t->coalescer);
+	limiter_destroy(&t->limiter);
+}
+
+static void audit_event_handle_aggregate(auparse_state_t *au)
+{
+	struct audit_record *rec = NULL;
+	struct jalp_structured_data *sd = NULL;
+	struct jalp_param *params = NULL;
+	int lane = LANE_LOW;
+
+	// The event goes into the lane of its most important record.
+	auparse_first_record(au);
+	do {
+		if (record_skipped_count(au)) {
+			continue;
+		}
+		lane = MIN(lane, record_lane(auparse_get_type(au)));
+		if (!rec) {
+			rec = record_start();
+			if (!rec) {
+				syslog(LOG_ERR, "failure allocating audit record");
+				return;
+			}
+		}
+		if (convert_mode == CONVERT_SENDER) {
+			continue;
+		}
+		if (record_add_fields(au, rec, &params) < 0) {
+			goto out;
+		}
+		if (!record_add_sd(rec, &sd)) {
+			syslog(LOG_ERR, "failure appending JALP audit structured data");
+			goto out;
+		}
+		sd->param_list = params;
+	} while (auparse_next_record(au) > 0);
+
+	if (!rec) {
+		// Every record of the event was filtered
+		return;
+	}
+
+	if (convert_mode == CONVERT_SENDER) {
+		if (record_pack_event(au, rec) < 0) {
+			syslog(LOG_ERR, "failure packing audit event");
+			goto out;
+		}
+	} else {
+		rec->log.message = record_event_text(au, rec);
+		if (!rec->log.message) {
+			syslog(LOG_ERR, "failure retrieving auparse record text");
+			goto out;
+		}
+	}
+
+	rec->lane = lane;
+	record_emit(&rec);
+out:
+	record_release(&rec);
+}
+
+static void audit_event_convert(auparse_state_t *au)
+{
+	struct audit_record *rec = NULL;
+	int lane;
+
+	if (aggregate_mode == AGGREGATE_EVENT) {
+		audit_event_handle_aggregate(au);
+		return;
+	}
+
+	auparse_first_record(au);
+	do {
+		if (record_skipped_count(au)) {
+			continue;
+		}
+
+		rec = record_start();
+		if (!rec) {
+			syslog(LOG_ERR, "failure allocating audit record");
+			goto out;
+		}
+		rec->lane = record_lane(auparse_get_type(au));
+
+		if (convert_mode == CONVERT_SENDER) {
+			if (record_pack(au, rec) < 0) {
+				syslog(LOG_ERR, "failure packing audit record");
+				goto out;
+			}
+		} else {
+			if (record_add_fields(au, rec, &rec->sd.param_list) < 0) {
+				goto out;
+			}
+			rec->log.message = arena_strdup(rec, auparse_get_record_text(au));
+			if (!rec->log.message) {
+				syslog(LOG_ERR, "failure retrieving auparse record text");
+				goto out;
+			}
+		}
+
+		// A low priority record is discarded without waiting. Once a
+		// wait for space has timed out, the rest of the event is
+		// discarded as well.
+		lane = rec->lane;
+		if (record_emit(&rec) < 0 && lane != LANE_LOW) {
+			goto out;
+		}
+	} while (auparse_next_record(au) > 0);
+	return;
+out:
+	record_release(&rec);
+}
+
+/* The auparse callback. user_data is the event_tables of the thread. */
+static void audit_event_handle(auparse_state_t *au,
+			auparse_cb_event_t event_type,
+			void *user_data)
+{
+	struct event_tables *tables = user_data;
+	struct coalesce_entry *entry = NULL;
+
+	if (event_type != AUPARSE_CB_EVENT_READY) {
+		return;
+	}
+
+	if (event_skipped(au)) {
+		STAT_INC(events_filtered);
+		return;
+	}
+	if (replay) {
+		audit_event_convert(au);
+		return;
+	}
+	if (coalesce_event(tables->coalescer, au, &entry) == COALESCE_DROP) {
+		return;
+	}
+	if (limit_event(tables->limiter, au)) {
+		STAT_INC(events_limited);
+	} else {
+		event_shed = queue_congestion();
+		if (entry) {
+			event_hold = &entry->held;
+		}
+		audit_event_convert(au);
+		event_hold = NULL;
+	}
+	if (entry && !entry->held) {
+		// Nothing was held, so let the next repeat try again.
+		entry->repeats = 0;
+	}
+}
+
+static void filter_list_free(char ***list, int *count)
+{
+	while (*count > 0) {
+		free((*list)[--*count]);
+	}
+	free(*list);
+	*list = NULL;
+}
+
+static void filter_destroy(void)
+{
+	if (excluded_keys) {
+		g_hash_table_destroy(excluded_keys);
+		excluded_keys = NULL;
+	}
+	if (excluded_fields) {
+		g_hash_table_destroy(excluded_fields);
+		excluded_fields = NULL;
+	}
+	if (interpreted_fields) {
+		g_hash_table_destroy(interpreted_fields);
+		interpreted_fields = NULL;
+	}
+	filter_list_free(&coalesce_fields, &coalesce_field_count);
+	filter_list_free(&rate_limit_fields, &rate_limit_field_count);
+}
+
+static int filter_type(const char *name)
+{
+	int type = audit_name_to_msg_type(name);
+
+	if (type <= 0 || type >= AUDIT_TYPE_MAX) {
+		syslog(LOG_ERR, "unknown record type \"%s\" in filter, ignoring", name);
+		return -1;
+	}
+	return type;
+}
+
+/*
+ * Set or clear the bits of the types named by entry in map. A trailing
+ * '*' matches every type whose name starts with the rest of the entry,
+ * so "ANOM_*" covers all anomaly records.
+ */
+static void filter_type_bits(unsigned char *map, const char *entry, int set)
+{
+	size_t len = strlen(entry);
+	const char *name;
+	int matched = 0;
+	int type;
+
+	if (len == 0 || entry[len - 1] != '*') {
+		if ((type = filter_type(entry)) > 0) {
+			TYPE_BIT_ASSIGN(map, type, set);
+		}
+		return;
+	}
+	for (type = 1; type < AUDIT_TYPE_MAX; type++) {
+		name = audit_msg_type_to_name(type);
+		if (name && strncmp(name, entry, len - 1) == 0) {
+			TYPE_BIT_ASSIGN(map, type, set);
+			matched++;
+		}
+	}
+	if (!matched) {
+		syslog(LOG_ERR, "no record type matches \"%s\" in filter, ignoring", entry);
+	}
+}
+
+/* filter_type_bits() for every entry of the list setting name. */
+static void filter_type_list(config_t *config, const char *name, unsigned char *map, int set)
+{
+	config_setting_t *list = config_lookup(config, name);
+	const char *entry;
+	int i;
+
+	for (i = 0; list && i < config_setting_length(list); i++) {
+		entry = config_setting_get_string_elem(list, i);
+		if (entry) {
+			filter_type_bits(map, entry, set);
+		}
+	}
+}
+
+/* Copy the strings of the list setting name into *list. */
+static int filter_list_load(config_t *config, const char *name,
+		char ***list, int *count)
+{
+	config_setting_t *setting = config_lookup(config, name);
+	const char *entry;
+	int i;
+
+	if (!setting || config_setting_length(setting) == 0) {
+		return 0;
+	}
+	*list = calloc(config_setting_length(setting), sizeof(**list));
+	if (!*list) {
+		return -1;
+	}
+	for (i = 0; i < config_setting_length(setting); i++) {
+		entry = config_setting_get_string_elem(setting, i);
+		if (!entry) {
+			continue;
+		}
+		(*list)[*count] = strdup(entry);
+		if (!(*list)[*count]) {
+			return -1;
+		}
+		(*count)++;
+	}
+	return 0;
+}
+
+/*
+ * Add the field filters of the list setting name, "field" or
+ * "TYPE.field", to table.
+ */
+static int field_filter_load(config_t *config, const char *name, GHashTable *table)
+{
+	config_setting_t *list;
+	struct field_filter *filter;
+	const char *entry;
+	const char *dot;
+	char type_name[64];
+	int i;
+	int type;
+
+	list = config_lookup(config, name);
+	for (i = 0; list && i < config_setting_length(list); i++) {
+		entry = config_setting_get_string_elem(list, i);
+		if (!entry) {
+			continue;
+		}
+		type = 0;
+		dot = strchr(entry, '.');
+		if (dot) {
+			if ((size_t)(dot - entry) >= sizeof(type_name)) {
+				syslog(LOG_ERR, "invalid field filter \"%s\", ignoring", entry);
+				continue;
+			}
+			memcpy(type_name, entry, dot - entry);
+			type_name[dot - entry] = '\0';
+			type = filter_type(type_name);
+			if (type < 0) {
+				continue;
+			}
+			entry = dot + 1;
+		}
+		filter = g_hash_table_lookup(table, entry);
+		if (!filter) {
+			filter = calloc(1, sizeof(*filter));
+			if (!filter) {
+				return -1;
+			}
+			g_hash_table_insert(table, strdup(entry), filter);
+		}
+		if (type > 0) {
+			TYPE_BIT_SET(filter->types, type);
+		} else {
+			filter->any_type = 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Build the filter and priority tables from include_types, exclude_types,
+ * shed_types, high_priority_types, low_priority_types, exclude_keys and
+ * exclude_fields, and the lists of coalesce_fields and rate_limit_fields.
+ * Entries of exclude_fields are either a field name, suppressed in every
+ * record, or TYPE.field, suppressed only in records of that type.
+ */
+static int filter_load(config_t *config)
+{
+	config_setting_t *list;
+	const char *entry;
+	int i;
+
+	filter_destroy();
+	memset(dropped_types, 0, sizeof(dropped_types));
+	memset(shed_types, 0, sizeof(shed_types));
+	memset(high_priority_types, 0, sizeof(high_priority_types));
+	memset(low_priority_types, 0, sizeof(low_priority_types));
+	drop_unlisted_types = 0;
+
+	excluded_keys = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+	excluded_fields = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+	interpreted_fields = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+	if (!excluded_keys || !excluded_fields || !interpreted_fields) {
+		return -1;
+	}
+
+	list = config_lookup(config, INCLUDETYPES);
+	if (list && config_setting_length(list) > 0) {
+		memset(dropped_types, 0xff, sizeof(dropped_types));
+		drop_unlisted_types = 1;
+		filter_type_list(config, INCLUDETYPES, dropped_types, 0);
+	}
+	filter_type_list(config, EXCLUDETYPES, dropped_types, 1);
+	filter_type_list(config, SHEDTYPES, shed_types, 1);
+	filter_type_list(config, HIGHPRIORITYTYPES, high_priority_types, 1);
+	filter_type_list(config, LOWPRIORITYTYPES, low_priority_types, 1);
+
+	list = config_lookup(config, EXCLUDEKEYS);
+	for (i = 0; list && i < config_setting_length(list); i++) {
+		entry = config_setting_get_string_elem(list, i);
+		if (entry) {
+			g_hash_table_insert(excluded_keys, strdup(entry), (gpointer)1);
+		}
+	}
+
+	if (field_filter_load(config, EXCLUDEFIELDS, excluded_fields) < 0 ||
+			field_filter_load(config, INTERPRETFIELDS, interpreted_fields) < 0) {
+		return -1;
+	}
+	if (convert_mode == CONVERT_SENDER && g_hash_table_size(interpreted_fields) > 0) {
+		syslog(LOG_ERR, "interpret_fields is ignored with convert = \"sender\"");
+	}
+
+	if (filter_list_load(config, COALESCEFIELDS, &coalesce_fields,
+				&coalesce_field_count) < 0 ||
+			filter_list_load(config, RATELIMITFIELDS, &rate_limit_fields,
+				&rate_limit_field_count) < 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Parse a CPU list such as "0-3,8" into set. */
+static int cpu_list_parse(const char *list, cpu_set_t *set)
+{
+	unsigned long first;
+	unsigned long last;
+	char *end;
+
+	CPU_ZERO(set);
+	do {
+		errno = 0;
+		first = strtoul(list, &end, 10);
+		if (errno || end == list) {
+			return -1;
+		}
+		last = first;
+		if (*end == '-') {
+			list = end + 1;
+			last = strtoul(list, &end, 10);
+			if (errno || end == list || last < first) {
+				return -1;
+			}
+		}
+		if (last >= CPU_SETSIZE) {
+			return -1;
+		}
+		for (; first <= last; first++) {
+			CPU_SET(first, set);
+		}
+		list = end + 1;
+	} while (*end == ',');
+	return *end == '\0' && CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+/* Parse a scheduling policy, "fifo" and "rr" with an optional ":priority". */
+static int sched_policy_parse(const char *str, int *policy, int *priority)
+{
+	const char *colon = strchr(str, ':');
+	size_t len = colon ? (size_t)(colon - str) : strlen(str);
+	char *end;
+
+	*priority = 0;
+	if (len == 5 && strncmp(str, "other", len) == 0) {
+		*policy = SCHED_OTHER;
+	} else if (len == 5 && strncmp(str, "batch", len) == 0) {
+		*policy = SCHED_BATCH;
+	} else if (len == 4 && strncmp(str, "idle", len) == 0) {
+		*policy = SCHED_IDLE;
+	} else if (len == 4 && strncmp(str, "fifo", len) == 0) {
+		*policy = SCHED_FIFO;
+		*priority = 1;
+	} else if (len == 2 && strncmp(str, "rr", len) == 0) {
+		*policy = SCHED_RR;
+		*priority = 1;
+	} else {
+		return -1;
+	}
+	if (colon) {
+		if (*priority == 0) {
+			return -1;
+		}
+		*priority = (int)strtol(colon + 1, &end, 10);
+		if (end == colon + 1 || *end != '\0' ||
+				*priority < sched_get_priority_min(*policy) ||
+				*priority > sched_get_priority_max(*policy)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Read <class>_cpus, <class>_policy and <class>_nice for every class. */
+static void thread_config_load(config_t *config)
+{
+	struct thread_class *tc;
+	const char *str;
+	char name[32];
+	int class;
+#if defined(LIBCONFIG_VER_MAJOR) \
+	&& (((LIBCONFIG_VER_MAJOR == 1) && (LIBCONFIG_VER_MINOR >= 4)) \
+	|| (LIBCONFIG_VER_MAJOR > 1))
+	int nice_value;
+#else
+	long nice_value;
+#endif
+
+	for (class = 0; class < THREAD_CLASS_COUNT; class++) {
+		tc = &thread_classes[class];
+		tc->set_cpus = 0;
+		tc->set_policy = 0;
+		tc->set_nice = 0;
+
+		snprintf(name, sizeof(name), "%s_cpus", tc->name);
+		if (config_lookup_string(config, name, &str) == CONFIG_TRUE) {
+			if (cpu_list_parse(str, &tc->cpus) == 0) {
+				tc->set_cpus = 1;
+			} else {
+				syslog(LOG_ERR, "invalid %s \"%s\".  Ignoring", name, str);
+			}
+		}
+		snprintf(name, sizeof(name), "%s_policy", tc->name);
+		if (config_lookup_string(config, name, &str) == CONFIG_TRUE) {
+			if (sched_policy_parse(str, &tc->policy, &tc->priority) == 0) {
+				tc->set_policy = 1;
+			} else {
+				syslog(LOG_ERR, "invalid %s \"%s\".  Ignoring", name, str);
+			}
+		}
+		snprintf(name, sizeof(name), "%s_nice", tc->name);
+		if (config_lookup_int(config, name, &nice_value) == CONFIG_TRUE) {
+			if (nice_value >= -20 && nice_value <= 19) {
+				tc->nice = (int)nice_value;
+				tc->set_nice = 1;
+			} else {
+				syslog(LOG_ERR, "%s must be between -20 and 19.  Ignoring", name);
+			}
+		}
+	}
+}
+
+static int config_load(config_t *config)
+{
+	int rc = 0;
+
+	if (!config) {
+		rc = -1;
+		goto out;
+	}
+
+	rc = config_read_file(config, config_path);
+	if (rc != CONFIG_TRUE) {
+		syslog(LOG_ERR, "failure reading config file, rc: %d, %s, line: %d", rc,
+						config_error_text(config),
+						config_error_line(config));
+		goto out;
+	}
+#if defined(LIBCONFIG_VER_MAJOR) \
+	&& (((LIBCONFIG_VER_MAJOR == 1) && (LIBCONFIG_VER_MINOR >= 4)) \
+	|| (LIBCONFIG_VER_MAJOR > 1))
+	config_lookup_int(config,PRINTSTATS, &print_stats);
+	config_lookup_int(config,PRINTSTATSFREQ, &print_stats_freq);
+	config_lookup_int(config,QUEUEMAXLENGTH, &queue_max_length);
+	config_lookup_int(config,QUEUEMAXBYTES, &queue_max_bytes);
+	config_lookup_int(config,QUEUEHIGHWATERMARK, &queue_high_watermark);
+	config_lookup_int(config,QUEUELOWWATERMARK, &queue_low_watermark);
+	config_lookup_int(config,HIGHPRIORITYWEIGHT, &lane_weights[LANE_HIGH]);
+	config_lookup_int(config,NORMALPRIORITYWEIGHT, &lane_weights[LANE_NORMAL]);
+	config_lookup_int(config,LOWPRIORITYWEIGHT, &lane_weights[LANE_LOW]);
+	config_lookup_int(config,SENDERTHREADS, &sender_threads);
+	config_lookup_int(config,BATCHMAXRECORDS, &batch_max_records);
+	config_lookup_int(config,BATCHMAXDELAYMS, &batch_max_delay_ms);
+	config_lookup_int(config,SPOOLSEGMENTSIZE, &spool_segment_size);
+	config_lookup_int(config,SPOOLMAXSEGMENTS, &spool_max_segments);
+	config_lookup_int(config,DRAINTIMEOUT, &drain_timeout);
+	config_lookup_int(config,AGINGPERIODMS, &aging_period_ms);
+	config_lookup_int(config,PARSERTHREADS, &parser_threads);
+	config_lookup_int(config,COALESCEWINDOWMS, &coalesce_window_ms);
+	config_lookup_int(config,COALESCEMAXENTRIES, &coalesce_max_entries);
+	config_lookup_int(config,RATELIMIT, &rate_limit);
+	config_lookup_int(config,RATELIMITBURST, &rate_limit_burst);
+	config_lookup_int(config,RATELIMITMAXSOURCES, &rate_limit_max_sources);
+	config_lookup_int(config,OVERLOADTIMEOUT, &overload_timeout);
+	config_lookup_int(config,RECONNECTMINMS, &reconnect_min_ms);
+	config_lookup_int(config,RECONNECTMAXMS, &reconnect_max_ms);
+#else
+	long print_stats_long = print_stats;
+	long print_stats_freq_long = print_stats_freq;
+	long queue_max_length_long = queue_max_length;
+	long queue_max_bytes_long = queue_max_bytes;
+	long queue_high_watermark_long = queue_high_watermark;
+	long queue_low_watermark_long = queue_low_watermark;
+	long high_priority_weight_long = lane_weights[LANE_HIGH];
+	long normal_priority_weight_long = lane_weights[LANE_NORMAL];
+	long low_priority_weight_long = lane_weights[LANE_LOW];
+	long sender_threads_long = sender_threads;
+	long batch_max_records_long = batch_max_records;
+	long batch_max_delay_ms_long = batch_max_delay_ms;
+	long spool_segment_size_long = spool_segment_size;
+	long spool_max_segments_long = spool_max_segments;
+	long drain_timeout_long = drain_timeout;
+	long aging_period_ms_long = aging_period_ms;
+	long parser_threads_long = parser_threads;
+	long coalesce_window_ms_long = coalesce_window_ms;
+	long coalesce_max_entries_long = coalesce_max_entries;
+	long rate_limit_long = rate_limit;
+	long rate_limit_burst_long = rate_limit_burst;
+	long rate_limit_max_sources_long = rate_limit_max_sources;
+	long overload_timeout_long = overload_timeout;
+	long reconnect_min_ms_long = reconnect_min_ms;
+	long reconnect_max_ms_long = reconnect_max_ms;
+	config_lookup_int(config,PRINTSTATS, &print_stats_long);
+	config_lookup_int(config,PRINTSTATSFREQ, &print_stats_freq_long);
+	config_lookup_int(config,QUEUEMAXLENGTH, &queue_max_length_long);
+	config_lookup_int(config,QUEUEMAXBYTES, &queue_max_bytes_long);
+	config_lookup_int(config,QUEUEHIGHWATERMARK, &queue_high_watermark_long);
+	config_lookup_int(config,QUEUELOWWATERMARK, &queue_low_watermark_long);
+	config_lookup_int(config,HIGHPRIORITYWEIGHT, &high_priority_weight_long);
+	config_lookup_int(config,NORMALPRIORITYWEIGHT, &normal_priority_weight_long);
+	config_lookup_int(config,LOWPRIORITYWEIGHT, &low_priority_weight_long);
+	config_lookup_int(config,SENDERTHREADS, &sender_threads_long);
+	config_lookup_int(config,BATCHMAXRECORDS, &batch_max_records_long);
+	config_lookup_int(config,BATCHMAXDELAYMS, &batch_max_delay_ms_long);
+	config_lookup_int(config,SPOOLSEGMENTSIZE, &spool_segment_size_long);
+	config_lookup_int(config,SPOOLMAXSEGMENTS, &spool_max_segments_long);
+	config_lookup_int(config,DRAINTIMEOUT, &drain_timeout_long);
+	config_lookup_int(config,AGINGPERIODMS, &aging_period_ms_long);
+	config_lookup_int(config,PARSERTHREADS, &parser_threads_long);
+	config_lookup_int(config,COALESCEWINDOWMS, &coalesce_window_ms_long);
+	config_lookup_int(config,COALESCEMAXENTRIES, &coalesce_max_entries_long);
+	config_lookup_int(config,RATELIMIT, &rate_limit_long);
+	config_lookup_int(config,RATELIMITBURST, &rate_limit_burst_long);
+	config_lookup_int(config,RATELIMITMAXSOURCES, &rate_limit_max_sources_long);
+	config_lookup_int(config,OVERLOADTIMEOUT, &overload_timeout_long);
+	config_lookup_int(config,RECONNECTMINMS, &reconnect_min_ms_long);
+	config_lookup_int(config,RECONNECTMAXMS, &reconnect_max_ms_long);
+	if(print_stats_long > INT_MAX){
+		syslog(LOG_ERR, "print_stats in config file is too big.  Using default value");
+	}else{
+		print_stats = (int)print_stats_long;
+	}
+	if(print_stats_freq_long > INT_MAX){
+		syslog(LOG_ERR, "print_stats_freq in config file is too big.  Using default value");
+	}else{
+		print_stats_freq = (int)print_stats_freq_long;
+	}
+	if(queue_max_length_long > INT_MAX){
+		syslog(LOG_ERR, "queue_max_length in config file is too big.  Using default value");
+	}else{
+		queue_max_length = (int)queue_max_length_long;
+	}
+	if(queue_max_bytes_long > INT_MAX){
+		syslog(LOG_ERR, "queue_max_bytes in config file is too big.  Using default value");
+	}else{
+		queue_max_bytes = (int)queue_max_bytes_long;
+	}
+	if(queue_high_watermark_long > INT_MAX){
+		syslog(LOG_ERR, "queue_high_watermark in config file is too big.  Using default value");
+	}else{
+		queue_high_watermark = (int)queue_high_watermark_long;
+	}
+	if(queue_low_watermark_long > INT_MAX){
+		syslog(LOG_ERR, "queue_low_watermark in config file is too big.  Using default value");
+	}else{
+		queue_low_watermark = (int)queue_low_watermark_long;
+	}
+	if(high_priority_weight_long > INT_MAX){
+		syslog(LOG_ERR, "high_priority_weight in config file is too big.  Using default value");
+	}else{
+		lane_weights[LANE_HIGH] = (int)high_priority_weight_long;
+	}
+	if(normal_priority_weight_long > INT_MAX){
+		syslog(LOG_ERR, "normal_priority_weight in config file is too big.  Using default value");
+	}else{
+		lane_weights[LANE_NORMAL] = (int)normal_priority_weight_long;
+	}
+	if(low_priority_weight_long > INT_MAX){
+		syslog(LOG_ERR, "low_priority_weight in config file is too big.  Using default value");
+	}else{
+		lane_weights[LANE_LOW] = (int)low_priority_weight_long;
+	}
+	if(sender_threads_long > INT_MAX){
+		syslog(LOG_ERR, "sender_threads in config file is too big.  Using default value");
+	}else{
+		sender_threads = (int)sender_threads_long;
+	}
+	if(batch_max_records_long > INT_MAX){
+		syslog(LOG_ERR, "batch_max_records in config file is too big.  Using default value");
+	}else{
+		batch_max_records = (int)batch_max_records_long;
+	}
+	if(batch_max_delay_ms_long > INT_MAX){
+		syslog(LOG_ERR, "batch_max_delay_ms in config file is too big.  Using default value");
+	}else{
+		batch_max_delay_ms = (int)batch_max_delay_ms_long;
+	}
+	if(spool_segment_size_long > INT_MAX){
+		syslog(LOG_ERR, "spool_segment_size in config file is too big.  Using default value");
+	}else{
+		spool_segment_size = (int)spool_segment_size_long;
+	}
+	if(spool_max_segments_long > INT_MAX){
+		syslog(LOG_ERR, "spool_max_segments in config file is too big.  Using default value");
+	}else{
+		spool_max_segments = (int)spool_max_segments_long;
+	}
+	if(drain_timeout_long > INT_MAX){
+		syslog(LOG_ERR, "drain_timeout in config file is too big.  Using default value");
+	}else{
+		drain_timeout = (int)drain_timeout_long;
+	}
+	if(aging_period_ms_long > INT_MAX){
+		syslog(LOG_ERR, "aging_period_ms in config file is too big.  Using default value");
+	}else{
+		aging_period_ms = (int)aging_period_ms_long;
+	}
+	if(parser_threads_long > INT_MAX){
+		syslog(LOG_ERR, "parser_threads in config file is too big.  Using default value");
+	}else{
+		parser_threads = (int)parser_threads_long;
+	}
+	if(coalesce_window_ms_long > INT_MAX){
+		syslog(LOG_ERR, "coalesce_window_ms in config file is too big.  Using default value");
+	}else{
+		coalesce_window_ms = (int)coalesce_window_ms_long;
+	}
+	if(coalesce_max_entries_long > INT_MAX){
+		syslog(LOG_ERR, "coalesce_max_entries in config file is too big.  Using default value");
+	}else{
+		coalesce_max_entries = (int)coalesce_max_entries_long;
+	}
+	if(rate_limit_long > INT_MAX){
+		syslog(LOG_ERR, "rate_limit in config file is too big.  Using default value");
+	}else{
+		rate_limit = (int)rate_limit_long;
+	}
+	if(rate_limit_burst_long > INT_MAX){
+		syslog(LOG_ERR, "rate_limit_burst in config file is too big.  Using default value");
+	}else{
+		rate_limit_burst = (int)rate_limit_burst_long;
+	}
+	if(rate_limit_max_sources_long > INT_MAX){
+		syslog(LOG_ERR, "rate_limit_max_sources in config file is too big.  Using default value");
+	}else{
+		rate_limit_max_sources = (int)rate_limit_max_sources_long;
+	}
+	if(overload_timeout_long > INT_MAX){
+		syslog(LOG_ERR, "overload_timeout in config file is too big.  Using default value");
+	}else{
+		overload_timeout = (int)overload_timeout_long;
+	}
+	if(reconnect_min_ms_long > INT_MAX){
+		syslog(LOG_ERR, "reconnect_min_ms in config file is too big.  Using default value");
+	}else{
+		reconnect_min_ms = (int)reconnect_min_ms_long;
+	}
+	if(reconnect_max_ms_long > INT_MAX){
+		syslog(LOG_ERR, "reconnect_max_ms in config file is too big.  Using default value");
+	}else{
+		reconnect_max_ms = (int)reconnect_max_ms_long;
+	}
+
+#endif
+	const char *payload_str = NULL;
+	if (config_lookup_string(config, PAYLOAD, &payload_str) == CONFIG_TRUE) {
+		if (0 == strcmp(payload_str, "record")) {
+			payload_mode = PAYLOAD_RECORD;
+		} else if (0 == strcmp(payload_str, "placeholder")) {
+			payload_mode = PAYLOAD_PLACEHOLDER;
+		} else {
+			syslog(LOG_ERR, "unknown payload \"%s\".  Using placeholder", payload_str);
+			payload_mode = PAYLOAD_PLACEHOLDER;
+		}
+	} else {
+		payload_mode = PAYLOAD_PLACEHOLDER;
+	}
+
+	const char *convert_str = NULL;
+	if (config_lookup_string(config, CONVERT, &convert_str) == CONFIG_TRUE) {
+		if (0 == strcmp(convert_str, "sender")) {
+			convert_mode = CONVERT_SENDER;
+		} else if (0 == strcmp(convert_str, "parser")) {
+			convert_mode = CONVERT_PARSER;
+		} else {
+			syslog(LOG_ERR, "unknown convert \"%s\".  Using parser", convert_str);
+			convert_mode = CONVERT_PARSER;
+		}
+	} else {
+		convert_mode = CONVERT_PARSER;
+	}
+
+	const char *input_str = NULL;
+	if (config_lookup_string(config, INPUT, &input_str) == CONFIG_TRUE) {
+		if (0 == strcmp(input_str, "netlink")) {
+			input_mode = INPUT_NETLINK;
+		} else if (0 == strcmp(input_str, "stdin")) {
+			input_mode = INPUT_STDIN;
+		} else {
+			syslog(LOG_ERR, "unknown input \"%s\".  Using stdin", input_str);
+			input_mode = INPUT_STDIN;
+		}
+	} else {
+		input_mode = INPUT_STDIN;
+	}
+
+	const char *aggregate_str = NULL;
+	if (config_lookup_string(config, AGGREGATE, &aggregate_str) == CONFIG_TRUE) {
+		if (0 == strcmp(aggregate_str, "event")) {
+			aggregate_mode = AGGREGATE_EVENT;
+		} else if (0 == strcmp(aggregate_str, "record")) {
+			aggregate_mode = AGGREGATE_RECORD;
+		} else {
+			syslog(LOG_ERR, "unknown aggregate \"%s\".  Using record", aggregate_str);
+			aggregate_mode = AGGREGATE_RECORD;
+		}
+	} else {
+		aggregate_mode = AGGREGATE_RECORD;
+	}
+
+	const char *stats_str = NULL;
+	free(stats_socket);
+	stats_socket = NULL;
+	if (config_lookup_string(config, STATSSOCKET, &stats_str) == CONFIG_TRUE) {
+		stats_socket = strdup(stats_str);
+	}
+	free(stats_listen);
+	stats_listen = NULL;
+	if (config_lookup_string(config, STATSLISTEN, &stats_str) == CONFIG_TRUE) {
+		stats_listen = strdup(stats_str);
+	}
+
+	const char *spool_str = NULL;
+	free(spool_dir);
+	spool_dir = NULL;
+	if (config_lookup_string(config, SPOOLDIR, &spool_str) == CONFIG_TRUE) {
+		spool_dir = strdup(spool_str);
+	}
+
+	const char *overload_str = NULL;
+	if (config_lookup_string(config, OVERLOADPOLICY, &overload_str) == CONFIG_TRUE) {
+		if (0 == strcmp(overload_str, "block")) {
+			overload_policy = OVERLOAD_BLOCK;
+		} else if (0 == strcmp(overload_str, "drop_newest")) {
+			overload_policy = OVERLOAD_DROP_NEWEST;
+		} else if (0 == strcmp(overload_str, "drop_oldest")) {
+			overload_policy = OVERLOAD_DROP_OLDEST;
+		} else if (0 == strcmp(overload_str, "drop_lowest_priority")) {
+			overload_policy = OVERLOAD_DROP_LOWEST;
+		} else if (0 == strcmp(overload_str, "spill")) {
+			overload_policy = OVERLOAD_SPILL;
+		} else {
+			syslog(LOG_ERR, "unknown overload_policy \"%s\".  Using block", overload_str);
+			overload_policy = OVERLOAD_BLOCK;
+		}
+	} else {
+		overload_policy = spool_dir ? OVERLOAD_SPILL : OVERLOAD_BLOCK;
+	}
+	if (overload_policy == OVERLOAD_SPILL && !spool_dir) {
+		syslog(LOG_ERR, "overload_policy spill needs a spool_dir.  Using block");
+		overload_policy = OVERLOAD_BLOCK;
+	}
+
+	thread_config_load(config);
+
+	if (filter_load(config) < 0) {
+		syslog(LOG_ERR, "failure loading record filters");
+		rc = -1;
+		goto out;
+	}
+
+	if (queue_max_length < 1) {
+		syslog(LOG_ERR, "queue_max_length must be at least 1.  Using 1");
+		queue_max_length = 1;
+	}
+	if (queue_max_bytes < 0) {
+		syslog(LOG_ERR, "queue_max_bytes must not be negative.  Using 0");
+		queue_max_bytes = 0;
+	}
+	if (queue_high_watermark < 1 || queue_high_watermark > 100) {
+		syslog(LOG_ERR, "queue_high_watermark must be between 1 and 100.  Using 90");
+		queue_high_watermark = 90;
+	}
+	if (queue_low_watermark < 0 || queue_low_watermark > queue_high_watermark) {
+		syslog(LOG_ERR, "queue_low_watermark must be between 0 and queue_high_watermark."
+				"  Using %d", queue_high_watermark);
+		queue_low_watermark = queue_high_watermark;
+	}
+	if (lane_weights[LANE_HIGH] < 0 || lane_weights[LANE_NORMAL] < 0 ||
+			lane_weights[LANE_LOW] < 0 || lane_weights[LANE_HIGH] > 1000 ||
+			lane_weights[LANE_NORMAL] > 1000 || lane_weights[LANE_LOW] > 1000 ||
+			lane_weights[LANE_HIGH] + lane_weights[LANE_NORMAL] +
+			lane_weights[LANE_LOW] == 0) {
+		syslog(LOG_ERR, "priority weights must be between 0 and 1000 and not all 0."
+				"  Using 4, 2 and 1");
+		lane_weights[LANE_HIGH] = 4;
+		lane_weights[LANE_NORMAL] = 2;
+		lane_weights[LANE_LOW] = 1;
+	}
+	if (sender_threads == 0) {
+		// One per CPU, for jalp_audit() calls that are bound by signing
+		sender_threads = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1L);
+	}
+	if (sender_threads < 1) {
+		syslog(LOG_ERR, "sender_threads must be at least 1.  Using 1");
+		sender_threads = 1;
+	}
+	if (batch_max_records < 1) {
+		syslog(LOG_ERR, "batch_max_records must be at least 1.  Using 1");
+		batch_max_records = 1;
+	}
+	if (batch_max_delay_ms < 0) {
+		syslog(LOG_ERR, "batch_max_delay_ms must not be negative.  Using 0");
+		batch_max_delay_ms = 0;
+	}
+	if (spool_segment_size < 65536) {
+		syslog(LOG_ERR, "spool_segment_size must be at least 65536.  Using 65536");
+		spool_segment_size = 65536;
+	}
+	if (spool_max_segments < 2) {
+		syslog(LOG_ERR, "spool_max_segments must be at least 2.  Using 2");
+		spool_max_segments = 2;
+	}
+	if (drain_timeout < 0) {
+		syslog(LOG_ERR, "drain_timeout must not be negative.  Using 0");
+		drain_timeout = 0;
+	}
+	if (aging_period_ms < 10) {
+		syslog(LOG_ERR, "aging_period_ms must be at least 10.  Using 10");
+		aging_period_ms = 10;
+	}
+	if (parser_threads < 1) {
+		syslog(LOG_ERR, "parser_threads must be at least 1.  Using 1");
+		parser_threads = 1;
+	}
+	if (coalesce_window_ms < 10) {
+		syslog(LOG_ERR, "coalesce_window_ms must be at least 10.  Using 10");
+		coalesce_window_ms = 10;
+	}
+	if (coalesce_max_entries < 1) {
+		syslog(LOG_ERR, "coalesce_max_entries must be at least 1.  Using 1");
+		coalesce_max_entries = 1;
+	}
+	if (rate_limit < 0) {
+		syslog(LOG_ERR, "rate_limit must not be negative.  Using 0");
+		rate_limit = 0;
+	}
+	if (rate_limit_burst < 0) {
+		syslog(LOG_ERR, "rate_limit_burst must not be negative.  Using 0");
+		rate_limit_burst = 0;
+	}
+	if (rate_limit_max_sources < 1) {
+		syslog(LOG_ERR, "rate_limit_max_sources must be at least 1.  Using 1");
+		rate_limit_max_sources = 1;
+	}
+	if (overload_timeout < 0) {
+		syslog(LOG_ERR, "overload_timeout must not be negative.  Using 0");
+		overload_timeout = 0;
+	}
+	if (reconnect_min_ms < 1) {
+		syslog(LOG_ERR, "reconnect_min_ms must be at least 1.  Using 1");
+		reconnect_min_ms = 1;
+	}
+	if (reconnect_max_ms < reconnect_min_ms) {
+		syslog(LOG_ERR, "reconnect_max_ms must be at least reconnect_min_ms.  Using %d",
+				reconnect_min_ms);
+		reconnect_max_ms = reconnect_min_ms;
+	}
+
+out:
+	return rc;
+}
+
+static int string_equal(const char *a, const char *b)
+{
+	return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+static void file_identity(const char *path, struct stat *st)
+{
+	memset(st, 0, sizeof(*st));
+	if (path && stat(path, st) < 0) {
+		memset(st, 0, sizeof(*st));
+	}
+}
+
+static int file_identity_equal(const struct stat *a, const struct stat *b)
+{
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+		a->st_size == b->st_size &&
+		a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+		a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/* Free a copy of a key, wiping it first. */
+static void secret_free(char *buf, size_t len)
+{
+	volatile char *p = buf;
+
+	while (p && len--) {
+		*p++ = 0;
+	}
+	free(buf);
+}
+
+/*
+ * Read the file at path into *buf and take its identity from the file
+ * that was read. On failure *buf is left NULL and the identity is taken
+ * from path, so the file is loaded by name.
+ */
+static void file_snapshot(const char *path, struct stat *st, char **buf, size_t *len)
+{
+	ssize_t n;
+	size_t got = 0;
+	int fd;
+
+	*buf = NULL;
+	*len = 0;
+	file_identity(path, st);
+	if (!path || (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		return;
+	}
+	if (fstat(fd, st) < 0 || st->st_size <= 0 ||
+			!(*buf = malloc(st->st_size))) {
+		goto fail;
+	}
+	while (got < (size_t)st->st_size) {
+		n = read(fd, *buf + got, st->st_size - got);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			goto fail;
+		}
+		got += n;
+	}
+	close(fd);
+	*len = got;
+	return;
+fail:
+	secret_free(*buf, got);
+	*buf = NULL;
+	file_identity(path, st);
+	close(fd);
+}
+
+static void connection_free(struct connection_config *cc)
+{
+	free(cc->socket);
+	free(cc->schemas);
+	free(cc->keypath);
+	free(cc->certpath);
+	secret_free(cc->key_pem, cc->key_pem_len);
+	secret_free(cc->cert_pem, cc->cert_pem_len);
+	memset(cc, 0, sizeof(*cc));
+}
+
+static char *config_strdup(config_t *config, const char *name)
+{
+	const char *value = NULL;
+
+	if (config_lookup_string(config, name, &value) != CONFIG_TRUE) {
+		return NULL;
+	}
+	return strdup(value);
+}
+
+/* Read the settings that require a new JALoP context when they change. */
+static void connection_load(config_t *config, struct connection_config *cc)
+{
+	memset(cc, 0, sizeof(*cc));
+	cc->socket = config_strdup(config, SOCKET);
+	cc->schemas = config_strdup(config, SCHEMAS);
+	cc->keypath = config_strdup(config, KEYPATH);
+	cc->certpath = config_strdup(config, CERTPATH);
+	// A key or cert replaced under the same name counts as a change.
+	file_snapshot(cc->keypath, &cc->key_identity, &cc->key_pem, &cc->key_pem_len);
+	file_snapshot(cc->certpath, &cc->cert_identity, &cc->cert_pem, &cc->cert_pem_len);
+}
+
+static int connection_equal(const struct connection_config *a,
+		const struct connection_config *b)
+{
+	return string_equal(a->socket, b->socket) &&
+		string_equal(a->schemas, b->schemas) &&
+		string_equal(a->keypath, b->keypath) &&
+		string_equal(a->certpath, b->certpath) &&
+		file_identity_equal(&a->key_identity, &b->key_identity) &&
+		file_identity_equal(&a->cert_identity, &b->cert_identity);
+}
+
+/*
+ * Put a copy of a file in an anonymous file for libjal, which only loads
+ * keys and certs by name. Returns the descriptor, with its name in path,
+ * or -1 if the file is to be loaded from where it is.
+ */
+static int snapshot_open(const char *buf, size_t len, char *path, size_t size)
+{
+#ifdef MFD_CLOEXEC
+	size_t done = 0;
+	ssize_t n;
+	int fd;
+
+	if (!buf || (fd = memfd_create("jalauditd", MFD_CLOEXEC)) < 0) {
+		return -1;
+	}
+	while (done < len) {
+		n = write(fd, buf + done, len - done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			close(fd);
+			return -1;
+		}
+		done += n;
+	}
+	snprintf(path, size, "/proc/self/fd/%d", fd);
+	if (access(path, R_OK) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+#else
+	UNUSED(buf);
+	UNUSED(len);
+	UNUSED(path);
+	UNUSED(size);
+	return -1;
+#endif
+}
+
+static int context_init(struct connection_config *cc, jalp_context *ctx)
+{
+	char path[64];
+	int fd;
+	int rc = 0;
+
+	if (!cc) {
+		rc = -1;
+		goto out;
+	}
+
+	rc = jalp_context_init(ctx, cc->socket, NULL, LOGGER_NAME, cc->schemas);
+
+	if (rc != JAL_OK) {
+		goto out;
+	}
+
+	if (cc->keypath != NULL) {
+		fd = snapshot_open(cc->key_pem, cc->key_pem_len, path, sizeof(path));
+		rc = jalp_context_load_pem_rsa(ctx, fd < 0 ? cc->keypath : path, NULL);
+		if (fd >= 0) {
+			close(fd);
+		}
+		if (rc != JAL_OK) {
+			goto out;
+		}
+	}
+
+	if (cc->certpath != NULL) {
+		fd = snapshot_open(cc->cert_pem, cc->cert_pem_len, path, sizeof(path));
+		rc = jalp_context_load_pem_cert(ctx, fd < 0 ? cc->certpath : path);
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+
+out:
+	return rc;
+}
+
+static jalp_context *context_create(struct connection_config *cc)
+{
+	jalp_context *ctx = jalp_context_create();
+	int rc;
+
+	if (!ctx) {
+		syslog(LOG_ERR, "failure creating JALP context");
+		return NULL;
+	}
+	rc = context_init(cc, ctx);
+	if (rc != JAL_OK) {
+		syslog(LOG_ERR, "failure resetting JALP context, rc: %d", rc);
+		jalp_context_destroy(&ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+static void log_histogram(const char *name, struct histogram *h)
+{
+	syslog(LOG_INFO, "%s usec: p50 %llu p90 %llu p99 %llu p99.9 %llu max %llu", name,
+			(unsigned long long)hist_percentile(h, 50) / 1000,
+			(unsigned long long)hist_percentile(h, 90) / 1000,
+			(unsigned long long)hist_percentile(h, 99) / 1000,
+			(unsigned long long)hist_percentile(h, 99.9) / 1000,
+			(unsigned long long)h->max / 1000);
+}
+
+/*
+ * Counters are reported as totals since startup, histograms as the
+ * difference since the previous report. The max of each histogram is
+ * the maximum since startup.
+ */
+static void* log_stats(void* ptr){
+	UNUSED(ptr);
+	static struct thread_stats total;
+	static struct thread_stats last;
+	static struct thread_stats interval;
+	unsigned int i;
+
+	thread_setup(THREAD_STATS, "jal-stats");
+
+	while(1){
+		sleep(print_stats_freq);
+		stats_collect(&total);
+		memcpy(&interval, &total, sizeof(interval));
+		for (i = 0; i < HIST_BUCKETS; i++) {
+			interval.enqueue_wait.counts[i] -= last.enqueue_wait.counts[i];
+			interval.residence.counts[i] -= last.residence.counts[i];
+			interval.send_time.counts[i] -= last.send_time.counts[i];
+		}
+		memcpy(&last, &total, sizeof(last));
+
+		syslog(LOG_INFO, "Max queue length seen: %lu", queue_max_length_seen);
+		syslog(LOG_INFO, "Current queue length: %lu (high priority %lu, low priority %lu)",
+				queue_length(), ring_length(event_lanes[LANE_HIGH]),
+				ring_length(event_lanes[LANE_LOW]));
+		syslog(LOG_INFO, "Queue bytes: %lu, max seen: %lu%s",
+				__atomic_load_n(&queue_bytes, __ATOMIC_RELAXED),
+				__atomic_load_n(&queue_max_bytes_seen, __ATOMIC_RELAXED),
+				__atomic_load_n(&queue_congested, __ATOMIC_RELAXED) ?
+				", congested" : "");
+		syslog(LOG_INFO, "Input reads: %llu, bytes: %llu, overruns: %llu",
+				(unsigned long long)total.input_reads,
+				(unsigned long long)total.input_bytes,
+				(unsigned long long)total.input_overruns);
+		syslog(LOG_INFO, "Records parsed: %llu, filtered: %llu, shed: %llu, "
+				"events filtered: %llu, coalesced: %llu, rate limited: %llu",
+				(unsigned long long)total.records_parsed,
+				(unsigned long long)total.records_filtered,
+				(unsigned long long)total.records_shed,
+				(unsigned long long)total.events_filtered,
+				(unsigned long long)total.events_coalesced,
+				(unsigned long long)total.events_limited);
+		syslog(LOG_INFO, "Records enqueued: %llu, dropped on full queue: %llu, sent: %llu, "
+				"send failures: %llu, reloads: %llu",
+				(unsigned long long)total.records_enqueued,
+				(unsigned long long)total.records_dropped,
+				(unsigned long long)total.records_sent,
+				(unsigned long long)total.send_failures,
+				(unsigned long long)total.reloads);
+		if (spool) {
+			syslog(LOG_INFO, "Records spilled: %llu, spooled: %lu",
+					(unsigned long long)total.records_spilled,
+					__atomic_load_n(&spool->records, __ATOMIC_RELAXED));
+		}
+		log_histogram("Enqueue wait", &interval.enqueue_wait);
+		log_histogram("Queue residence", &interval.residence);
+		log_histogram("jalp_audit", &interval.send_time);
+	}
+	return NULL;
+}
+
+/*
+ * Metrics exporter. The thread runs with SCHED_IDLE so scrapes never
+ * compete with parsing or sending. Counters are read with the same
+ * atomic loads log_stats uses; in addition the queue length is sampled
+ * every EXPORT_SAMPLE_MS so that bursts shorter than the scrape interval
+ * still show up in jalauditd_queue_length_max_window.
+ */
+#define EXPORT_SAMPLE_MS 100
+#define EXPORT_WINDOW_SAMPLES 100
+#define EXPORT_BUFFER_SIZE 16384
+
+struct exporter {
+	int fds[2];
+	int nfds;
+	char *unix_path;
+	unsigned long samples[EXPORT_WINDOW_SAMPLES];
+	unsigned int next_sample;
+	char buf[EXPORT_BUFFER_SIZE];
+	size_t len;
+};
+
+static pthread_t exporter_thread;
+static int exporter_running = 0;
+// Endpoints the exporter was last started for
+static char *exporter_socket = NULL;
+static char *exporter_listen = NULL;
+
+static void export_printf(struct exporter *ex, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void export_printf(struct exporter *ex, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (ex->len >= sizeof(ex->buf)) {
+		return;
+	}
+	va_start(ap, fmt);
+	n = vsnprintf(ex->buf + ex->len, sizeof(ex->buf) - ex->len, fmt, ap);
+	va_end(ap);
+	if (n > 0) {
+		ex->len = MIN(ex->len + n, sizeof(ex->buf));
+	}
+}
+
+static void export_counter(struct exporter *ex, const char *name, const char *help,
+		uint64_t value)
+{
+	export_printf(ex, "# HELP jalauditd_%s %s\n# TYPE jalauditd_%s counter\n"
+			"jalauditd_%s %llu\n", name, help, name, name,
+			(unsigned long long)value);
+}
+
+static void export_gauge(struct exporter *ex, const char *name, const char *help,
+		uint64_t value)
+{
+	export_printf(ex, "# HELP jalauditd_%s %s\n# TYPE jalauditd_%s gauge\n"
+			"jalauditd_%s %llu\n", name, help, name, name,
+			(unsigned long long)value);
+}
+
+static void export_histogram(struct exporter *ex, const char *name, const char *help,
+		struct histogram *h)
+{
+	static const double bounds[] = { 0.00001, 0.0001, 0.001, 0.01, 0.1, 1, 10 };
+	uint64_t count = 0;
+	unsigned int b = 0;
+	unsigned int i;
+
+	export_printf(ex, "# HELP jalauditd_%s %s\n# TYPE jalauditd_%s histogram\n",
+			name, help, name);
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		// A bucket counts towards a bound once all of it lies below.
+		while (b < sizeof(bounds) / sizeof(bounds[0])
+				&& hist_value(i + 1) > bounds[b] * 1e9) {
+			export_printf(ex, "jalauditd_%s_bucket{le=\"%g\"} %llu\n", name,
+					bounds[b], (unsigned long long)count);
+			b++;
+		}
+		count += h->counts[i];
+	}
+	export_printf(ex, "jalauditd_%s_bucket{le=\"+Inf\"} %llu\n", name,
+			(unsigned long long)count);
+	export_printf(ex, "jalauditd_%s_sum %.9f\n", name, h->sum / 1e9);
+	export_printf(ex, "jalauditd_%s_count %llu\n", name, (unsigned long long)count);
+}
+
+static void export_render(struct exporter *ex)
+{
+	static struct thread_stats total;
+	unsigned long window_max = 0;
+	unsigned int i;
+	int lane;
+
+	stats_collect(&total);
+	for (i = 0; i < EXPORT_WINDOW_SAMPLES; i++) {
+		window_max = MAX(window_max, ex->samples[i]);
+	}
+
+	ex->len = 0;
+	export_printf(ex, "HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n\r\n");
+	export_gauge(ex, "queue_length", "Records waiting to be sent.", queue_length());
+	export_gauge(ex, "queue_capacity", "Size of each lane of the record queue.",
+			event_lanes[LANE_NORMAL]->capacity);
+	export_printf(ex, "# HELP jalauditd_lane_length Records waiting in each priority lane.\n"
+			"# TYPE jalauditd_lane_length gauge\n");
+	for (lane = 0; lane < LANE_COUNT; lane++) {
+		export_printf(ex, "jalauditd_lane_length{lane=\"%s\"} %lu\n", lane_names[lane],
+				ring_length(event_lanes[lane]));
+	}
+	export_gauge(ex, "queue_length_max", "Highest queue length since startup.",
+			__atomic_load_n(&queue_max_length_seen, __ATOMIC_RELAXED));
+	export_gauge(ex, "queue_length_max_window",
+			"Highest queue length sampled over the last 10 seconds.", window_max);
+	export_gauge(ex, "queue_bytes", "Memory held by queued records.",
+			__atomic_load_n(&queue_bytes, __ATOMIC_RELAXED));
+	export_gauge(ex, "queue_bytes_limit", "queue_max_bytes, 0 if unlimited.",
+			queue_max_bytes);
+	export_gauge(ex, "queue_bytes_max", "Highest queue_bytes since startup.",
+			__atomic_load_n(&queue_max_bytes_seen, __ATOMIC_RELAXED));
+	export_gauge(ex, "queue_congested",
+			"1 if the queue was above its high watermark at the last event.",
+			__atomic_load_n(&queue_congested, __ATOMIC_RELAXED));
+	export_counter(ex, "input_reads_total", "read() calls returning audit input.",
+			total.input_reads);
+	export_counter(ex, "input_bytes_total", "Bytes of audit input read.",
+			total.input_bytes);
+	export_counter(ex, "input_overruns_total",
+			"Times the kernel dropped netlink audit messages.", total.input_overruns);
+	export_counter(ex, "records_parsed_total", "Records read from auparse.",
+			total.records_parsed);
+	export_counter(ex, "records_filtered_total", "Records dropped by type filters.",
+			total.records_filtered);
+	export_counter(ex, "records_shed_total", "shed_types records dropped under load.",
+			total.records_shed);
+	export_counter(ex, "events_filtered_total", "Events dropped by rule key filters.",
+			total.events_filtered);
+	export_counter(ex, "events_coalesced_total", "Repeated events counted instead of sent.",
+			total.events_coalesced);
+	export_counter(ex, "events_rate_limited_total", "Events suppressed by the rate limit.",
+			total.events_limited);
+	export_counter(ex, "records_enqueued_total", "Records queued for sending.",
+			total.records_enqueued);
+	export_counter(ex, "records_dropped_total", "Records dropped on a full queue.",
+			total.records_dropped);
+	export_counter(ex, "records_spilled_total", "Records written to the spool.",
+			total.records_spilled);
+	export_gauge(ex, "spool_records", "Records waiting in the spool.",
+			spool ? __atomic_load_n(&spool->records, __ATOMIC_RELAXED) : 0);
+	export_counter(ex, "records_sent_total", "Records sent to the local store.",
+			total.records_sent);
+	export_counter(ex, "send_failures_total", "Failed jalp_audit() calls.",
+			total.send_failures);
+	export_counter(ex, "reloads_total", "Configuration reloads.", total.reloads);
+	export_histogram(ex, "enqueue_wait_seconds", "Time spent waiting for queue space.",
+			&total.enqueue_wait);
+	export_histogram(ex, "queue_residence_seconds", "Time records spent queued.",
+			&total.residence);
+	export_histogram(ex, "jalp_audit_seconds", "Duration of jalp_audit() calls.",
+			&total.send_time);
+}
+
+static void export_serve(struct exporter *ex, int listen_fd)
+{
+	struct pollfd pfd;
+	char request[1024];
+	size_t sent = 0;
+	ssize_t n;
+	int fd;
+
+	fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0) {
+		return;
+	}
+	// Wait briefly for the request; its content does not matter.
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 1000) > 0) {
+		if (read(fd, request, sizeof(request)) < 0) {
+			goto out;
+		}
+	}
+	export_render(ex);
+	while (sent < ex->len) {
+		n = send(fd, ex->buf + sent, ex->len - sent, MSG_NOSIGNAL);
+		if (n <= 0) {
+			break;
+		}
+		sent += n;
+	}
+out:
+	close(fd);
+}
+
+static int export_listen_unix(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		syslog(LOG_ERR, "stats_socket path is too long: %s", path);
+		return -1;
+	}
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, path, strlen(path) + 1);
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+			|| chmod(path, 0600) < 0 || listen(fd, 16) < 0) {
+		syslog(LOG_ERR, "failure listening on %s: %s", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int export_listen_tcp(const char *spec)
+{
+	struct addrinfo hints;
+	struct addrinfo *res = NULL;
+	char host[256];
+	const char *colon = strrchr(spec, ':');
+	int one = 1;
+	int fd = -1;
+
+	if (!colon || (size_t)(colon - spec) >= sizeof(host)) {
+		syslog(LOG_ERR, "stats_listen must be host:port, not %s", spec);
+		return -1;
+	}
+	memcpy(host, spec, colon - spec);
+	host[colon - spec] = '\0';
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if (getaddrinfo(host[0] ? host : NULL, colon + 1, &hints, &res) != 0 || !res) {
+		syslog(LOG_ERR, "cannot resolve stats_listen %s", spec);
+		return -1;
+	}
+	fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, res->ai_protocol);
+	if (fd >= 0) {
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(fd, res->ai_addr, res->ai_addrlen) < 0 || listen(fd, 16) < 0) {
+			syslog(LOG_ERR, "failure listening on %s: %s", spec, strerror(errno));
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+static void exporter_cleanup(void *ptr)
+{
+	struct exporter *ex = ptr;
+	int i;
+
+	for (i = 0; i < ex->nfds; i++) {
+		close(ex->fds[i]);
+	}
+	if (ex->unix_path) {
+		unlink(ex->unix_path);
+		free(ex->unix_path);
+	}
+	free(ex);
+}
+
+static void *export_stats(void *ptr)
+{
+	struct sched_param param;
+	struct pollfd pfds[2];
+	struct exporter *ex = ptr;
+	int i;
+
+	thread_setup(THREAD_STATS, "jal-exporter");
+	if (!thread_classes[THREAD_STATS].set_policy) {
+		memset(&param, 0, sizeof(param));
+		pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+	}
+
+	pthread_cleanup_push(exporter_cleanup, ex);
+	for (i = 0; i < ex->nfds; i++) {
+		pfds[i].fd = ex->fds[i];
+		pfds[i].events = POLLIN;
+	}
+	while (1) {
+		if (poll(pfds, ex->nfds, EXPORT_SAMPLE_MS) > 0) {
+			for (i = 0; i < ex->nfds; i++) {
+				if (pfds[i].revents & POLLIN) {
+					export_serve(ex, ex->fds[i]);
+				}
+			}
+		}
+		ex->samples[ex->next_sample] = queue_length();
+		ex->next_sample = (ex->next_sample + 1) % EXPORT_WINDOW_SAMPLES;
+	}
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+
+static void exporter_stop(void)
+{
+	if (exporter_running) {
+		pthread_cancel(exporter_thread);
+		pthread_join(exporter_thread, NULL);
+		exporter_running = 0;
+	}
+	free(exporter_socket);
+	free(exporter_listen);
+	exporter_socket = NULL;
+	exporter_listen = NULL;
+}
+
+static int exporter_changed(void)
+{
+	return !string_equal(stats_socket, exporter_socket) ||
+		!string_equal(stats_listen, exporter_listen);
+}
+
+static void exporter_start(void)
+{
+	struct exporter *ex;
+	int fd;
+
+	exporter_socket = stats_socket ? strdup(stats_socket) : NULL;
+	exporter_listen = stats_listen ? strdup(stats_listen) : NULL;
+	if (!stats_socket && !stats_listen) {
+		return;
+	}
+	ex = calloc(1, sizeof(*ex));
+	if (!ex) {
+		syslog(LOG_ERR, "failure allocating stats exporter");
+		return;
+	}
+	if (stats_socket && (fd = export_listen_unix(stats_socket)) >= 0) {
+		ex->fds[ex->nfds++] = fd;
+		ex->unix_path = strdup(stats_socket);
+	}
+	if (stats_listen && (fd = export_listen_tcp(stats_listen)) >= 0) {
+		ex->fds[ex->nfds++] = fd;
+	}
+	if (ex->nfds == 0 || pthread_create(&exporter_thread, NULL, export_stats, ex) != 0) {
+		exporter_cleanup(ex);
+		return;
+	}
+	exporter_running = 1;
+}
+
+/*
+ * Each sender thread owns one JALoP context (and therefore one connection
+ * to the local store), so any number of senders may pop from the shared
+ * queue and call jalp_audit() concurrently.
+ *
+ * Records are taken from the queue in batches of up to batch_max_records
+ * and submitted back-to-back. The JALoP producer has no multi-record
+ * submission, so batching saves the queue wakeups rather than the
+ * per-record send.
+ *
+ * Senders are stopped by interrupting the queue: the batch in hand is
+ * finished and everything else stays queued for the next senders. A
+ * sender that is cancelled after drain_timeout hands its unsent records
+ * back from the cleanup handler.
+ *
+ * A sender whose connection fails hands its unsent records back as well,
+ * for the senders that still have one, and reconnects on its own after a
+ * backoff; libjal connects again on the next jalp_audit().
+ */
+struct sender_batch {
+	struct audit_record **records;
+	unsigned int size;
+	unsigned int len;
+	unsigned int next;
+};
+
+static void sender_batch_requeue(struct sender_batch *batch)
+{
+	unsigned int lost = 0;
+
+	for (; batch->next < batch->len; batch->next++) {
+		if (batch->records[batch->next] &&
+				record_requeue(&batch->records[batch->next]) < 0) {
+			lost++;
+		}
+	}
+	if (lost) {
+		syslog(LOG_ERR, "discarded %u queued records", lost);
+	}
+	batch->len = 0;
+	batch->next = 0;
+}
+
+static void sender_batch_free(void *ptr)
+{
+	struct sender_batch *batch = ptr;
+
+	sender_batch_requeue(batch);
+	free(batch->records);
+}
+
+/* Follow a change of batch_max_records, between batches. */
+static int sender_batch_resize(struct sender_batch *batch)
+{
+	struct audit_record **records;
+
+	if (batch->size == (unsigned int)batch_max_records) {
+		return 0;
+	}
+	records = realloc(batch->records, batch_max_records * sizeof(*records));
+	if (!records) {
+		return -1;
+	}
+	batch->records = records;
+	batch->size = batch_max_records;
+	return 0;
+}
+
+static void sender_exit(void *ptr)
+{
+	struct sender *sender = ptr;
+
+	stats_release(NULL);
+	__atomic_store_n(&sender->running, 0, __ATOMIC_SEQ_CST);
+	__atomic_sub_fetch(&senders_running, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Switch to a context handed over by main() after a reload. */
+static void sender_swap_context(struct sender *sender)
+{
+	jalp_context *ctx;
+
+	if (!__atomic_load_n(&sender->next_ctx, __ATOMIC_RELAXED)) {
+		return;
+	}
+	ctx = __atomic_exchange_n(&sender->next_ctx, NULL, __ATOMIC_ACQ_REL);
+	if (ctx) {
+		jalp_context_destroy(&sender->ctx);
+		sender->ctx = ctx;
+	}
+}
+
+/*
+ * Wait out the backoff after a failed send, doubling it for the next
+ * failure. Up to a quarter of it is taken off at random, so senders
+ * that lost their connections together do not retry in lockstep.
+ * Returns -1 if the senders are stopped meanwhile.
+ */
+static int sender_backoff(struct sender *sender)
+{
+	struct ring *r = event_lanes[LANE_NORMAL];
+	struct timespec pause;
+	long long deadline;
+	long long remaining_ms;
+
+	if (sender->backoff_ms == 0) {
+		sender->backoff_ms = reconnect_min_ms;
+	} else if (sender->backoff_ms <= reconnect_max_ms / 2) {
+		sender->backoff_ms *= 2;
+	} else {
+		sender->backoff_ms = reconnect_max_ms;
+	}
+	deadline = monotonic_ms() + sender->backoff_ms -
+		rand_r(&sender->seed) % (sender->backoff_ms / 4 + 1);
+	while (!ring_interrupted(r) && (remaining_ms = deadline - monotonic_ms()) > 0) {
+		remaining_ms = MIN(remaining_ms, 100LL);
+		pause.tv_sec = 0;
+		pause.tv_nsec = remaining_ms * 1000000;
+		nanosleep(&pause, NULL);
+	}
+	return ring_interrupted(r) ? -1 : 0;
+}
+
+/* Send batches until the queue is interrupted. */
+static void sender_loop(struct sender *sender, struct sender_batch *batch)
+{
+	int rc=0;	
+	struct audit_record *rec;
+	const uint8_t *payload = NULL;
+	size_t payload_size = 0;
+	long long start;
+
+	while(1){
+		if (sender_batch_resize(batch) < 0) {
+			syslog(LOG_ERR, "failure resizing sender batch");
+		}
+		batch->next = 0;
+		batch->len = ring_pop_batch(event_lanes[LANE_NORMAL], (void **)batch->records,
+				batch->size, batch_max_delay_ms, queue_check_data);
+		if (batch->len == 0) {
+			// Interrupted: the senders are being stopped
+			return;
+		}
+
+		for (; batch->next < batch->len; batch->next++) {
+			rec = batch->records[batch->next];
+			if (rec->packed && record_unpack(rec) < 0) {
+				syslog(LOG_ERR, "failure unpacking audit record");
+				STAT_INC(records_dropped);
+				record_discard(&batch->records[batch->next]);
+				continue;
+			}
+			if (payload_mode == PAYLOAD_RECORD) {
+				payload = (const uint8_t *)rec->log.message;
+				payload_size = strlen(rec->log.message);
+			} else {
+				payload = placeholder_payload;
+				payload_size = sizeof(placeholder_payload) - 1;
+			}
+			sender_swap_context(sender);
+			start = monotonic_ns();
+			hist_record(&my_stats->residence, start - rec->enqueued_ns);
+			rc = jalp_audit(sender->ctx, &rec->app, payload, payload_size);
+			hist_record(&my_stats->send_time, monotonic_ns() - start);
+			if (rc == JAL_OK) {
+				record_release(&batch->records[batch->next]);
+				STAT_INC(records_sent);
+				if (sender->failures > 0) {
+					syslog(LOG_INFO, "JALoP local store connection restored "
+							"after %u failed sends", sender->failures);
+					sender->failures = 0;
+					sender->backoff_ms = 0;
+				}
+				continue;
+			}
+			STAT_INC(send_failures);
+			if (rc == JAL_E_NOT_CONNECTED) {
+				break;
+			}
+			// Resending would fail the same way.
+			syslog(LOG_ERR, "failure sending JALP audit message, rc: %d", rc);
+			record_discard(&batch->records[batch->next]);
+		}
+		if (batch->next < batch->len) {
+			// Hand the unsent part of the batch, this record
+			// included, to a sender that is still connected.
+			sender_batch_requeue(batch);
+			if (sender->failures++ == 0) {
+				syslog(LOG_ERR, "failure sending JALP audit message, rc: %d, reconnecting",
+						rc);
+			}
+			if (sender_backoff(sender) < 0) {
+				return;
+			}
+		}
+	}
+}
+
+static void* send_messages_to_local_store(void* ptr)
+{
+	struct sender *sender = ptr;
+	struct sender_batch batch = { NULL, 0, 0, 0 };
+	char name[16];
+
+	snprintf(name, sizeof(name), "jal-sender-%d", sender->index);
+	thread_setup(THREAD_SENDER, name);
+
+	pthread_cleanup_push(sender_exit, sender);
+	pthread_cleanup_push(sender_batch_free, &batch);
+	if (stats_acquire() < 0) {
+		syslog(LOG_ERR, "failure allocating sender statistics");
+		status_request(RELOAD);
+	} else if (sender_batch_resize(&batch) < 0) {
+		syslog(LOG_ERR, "failure allocating sender batch");
+		status_request(RELOAD);
+	} else {
+		sender_loop(sender, &batch);
+	}
+	pthread_cleanup_pop(1);
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+
+static int realtime_deadline(struct timespec *ts, long long deadline_ms)
+{
+	long long remaining_ms = MAX(deadline_ms - monotonic_ms(), 0LL);
+
+	if (clock_gettime(CLOCK_REALTIME, ts) < 0) {
+		return -1;
+	}
+	ts->tv_sec += remaining_ms / 1000;
+	ts->tv_nsec += (remaining_ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+	return 0;
+}
+
+/*
+ * Interrupt the queue and wait until deadline_ms (on the monotonic_ms()
+ * clock) for the senders to finish their batches. Senders stuck in
+ * jalp_audit() past the deadline are cancelled.
+ */
+static void senders_stop(struct sender *senders, int count, long long deadline_ms)
+{
+	struct timespec deadline;
+	int i;
+
+	if (count == 0) {
+		return;
+	}
+	ring_interrupt(event_lanes[LANE_NORMAL], 1);
+	for (i = 0; i < count; i++) {
+		if (!senders[i].started) {
+			continue;
+		}
+		senders[i].started = 0;
+		if (realtime_deadline(&deadline, deadline_ms) == 0 &&
+				pthread_timedjoin_np(senders[i].thread, NULL, &deadline) == 0) {
+			continue;
+		}
+		syslog(LOG_ERR, "sender thread did not stop within %d seconds, cancelling",
+				drain_timeout);
+		pthread_cancel(senders[i].thread);
+		pthread_join(senders[i].thread, NULL);
+	}
+	ring_interrupt(event_lanes[LANE_NORMAL], 0);
+}
+
+/* Destroy the contexts of stopped sender slots. */
+static void senders_destroy(struct sender *senders, int count)
+{
+	int i;
+
+	if (!senders) {
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		jalp_context_destroy(&senders[i].ctx);
+		jalp_context_destroy(&senders[i].next_ctx);
+	}
+	free(senders);
+}
+
+/*
+ * Bring the senders in line with the configuration: restart senders that
+ * exited, grow or shrink the set to sender_threads, and if rebuild is set
+ * hand every running sender a context built from cc. Senders that need
+ * none of this keep running.
+ */
+static int senders_update(struct sender **senders, int *count,
+		struct connection_config *cc, int rebuild)
+{
+	struct sender *sender;
+	struct sender *resized;
+	jalp_context *ctx;
+	int i;
+
+	for (i = 0; i < *count; i++) {
+		sender = &(*senders)[i];
+		if (sender->started && !__atomic_load_n(&sender->running, __ATOMIC_SEQ_CST)) {
+			pthread_join(sender->thread, NULL);
+			sender->started = 0;
+		}
+	}
+
+	if (*count != sender_threads) {
+		senders_stop(*senders, *count, monotonic_ms() + (long long)drain_timeout * 1000);
+		for (i = sender_threads; i < *count; i++) {
+			jalp_context_destroy(&(*senders)[i].ctx);
+			jalp_context_destroy(&(*senders)[i].next_ctx);
+		}
+		resized = realloc(*senders, sender_threads * sizeof(**senders));
+		if (!resized) {
+			syslog(LOG_ERR, "failure allocating %d sender threads", sender_threads);
+			*count = MIN(*count, sender_threads);
+			return -1;
+		}
+		for (i = *count; i < sender_threads; i++) {
+			memset(&resized[i], 0, sizeof(resized[i]));
+		}
+		*senders = resized;
+		*count = sender_threads;
+	}
+
+	for (i = 0; i < *count; i++) {
+		sender = &(*senders)[i];
+		if (!sender->started && sender->next_ctx) {
+			jalp_context_destroy(&sender->ctx);
+			sender->ctx = sender->next_ctx;
+			sender->next_ctx = NULL;
+		}
+		if (!sender->ctx || rebuild) {
+			ctx = context_create(cc);
+			if (!ctx) {
+				return -1;
+			}
+			if (sender->started) {
+				ctx = __atomic_exchange_n(&sender->next_ctx, ctx, __ATOMIC_ACQ_REL);
+			} else {
+				jalp_context_destroy(&sender->ctx);
+				sender->ctx = ctx;
+				ctx = NULL;
+			}
+			// A context handed over earlier but never picked up
+			jalp_context_destroy(&ctx);
+		}
+		if (!sender->started) {
+			sender->running = 1;
+			sender->seed = (unsigned int)(monotonic_ns() ^ i);
+			sender->index = i;
+			__atomic_add_fetch(&senders_running, 1, __ATOMIC_SEQ_CST);
+			if (pthread_create(&sender->thread, NULL, &send_messages_to_local_store,
+						sender) != 0) {
+				__atomic_sub_fetch(&senders_running, 1, __ATOMIC_SEQ_CST);
+				sender->running = 0;
+				syslog(LOG_ERR, "failure creating sender thread");
+				return -1;
+			}
+			sender->started = 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Wait until deadline_ms for the senders to empty the queue. Records
+ * already in the spool stay there for the next start.
+ */
+static void queue_drain(long long deadline_ms)
+{
+	struct timespec pause = { 0, 10 * 1000 * 1000 };
+
+	while (queue_length() > 0 &&
+			__atomic_load_n(&senders_running, __ATOMIC_SEQ_CST) > 0 &&
+			monotonic_ms() < deadline_ms) {
+		nanosleep(&pause, NULL);
+	}
+}
+
+/*
+ * Write whatever is still queued to the spool, highest priority first and
+ * ahead of the records spooled earlier, or report how many records are
+ * lost without one. The senders must be stopped.
+ */
+static void queue_persist(void)
+{
+	struct audit_record **recs = NULL;
+	unsigned long count = 0;
+	unsigned long written = 0;
+	unsigned long len;
+	unsigned long i;
+	int lane;
+
+	len = queue_length();
+	if (len == 0) {
+		return;
+	}
+	recs = calloc(len, sizeof(*recs));
+	if (recs) {
+		for (lane = 0; lane < LANE_COUNT; lane++) {
+			while (count < len && (recs[count] = queue_try_pop(event_lanes[lane]))) {
+				count++;
+			}
+		}
+		if (spool) {
+			written = spool_prepend(recs, count);
+		}
+		// Only what did not make it into the spool is left.
+		for (i = 0; i < count; i++) {
+			record_discard(&recs[i]);
+		}
+		free(recs);
+	}
+	if (written) {
+		syslog(LOG_INFO, "spooled %lu queued records", written);
+	}
+	if (written < len) {
+		syslog(LOG_ERR, "discarded %lu queued records", len - written);
+	}
+}
+
+static void queue_destroy(struct ring **lanes)
+{
+	int lane;
+
+	for (lane = 0; lane < LANE_COUNT; lane++) {
+		ring_destroy(&lanes[lane]);
+	}
+}
+
+/* Create the lanes of a queue of capacity entries per lane. */
+static int queue_create(struct ring **lanes, unsigned long capacity)
+{
+	int lane;
+
+	for (lane = 0; lane < LANE_COUNT; lane++) {
+		lanes[lane] = ring_create(capacity);
+		if (!lanes[lane]) {
+			queue_destroy(lanes);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Replace the queue with one of capacity entries per lane, keeping the
+ * oldest records of each lane in it and spooling the rest. The senders,
+ * the exporter and the stats thread must be stopped.
+ */
+static int queue_resize(unsigned long capacity)
+{
+	struct ring *lanes[LANE_COUNT] = { NULL };
+	struct audit_record *rec;
+	int lane;
+
+	if (queue_create(lanes, capacity) < 0) {
+		return -1;
+	}
+	for (lane = 0; lane < LANE_COUNT; lane++) {
+		while (ring_length(lanes[lane]) < capacity &&
+				(rec = ring_try_pop(event_lanes[lane]))) {
+			ring_try_push(lanes[lane], rec);
+		}
+	}
+	queue_persist();
+	queue_destroy(event_lanes);
+	memcpy(event_lanes, lanes, sizeof(event_lanes));
+	syslog(LOG_INFO, "queue resized to %lu records per lane", capacity);
+	return 0;
+}
+
+static struct parse_chunk *chunk_alloc(void)
+{
+	struct parse_chunk *chunk = ring_try_pop(chunk_pool);
+
+	if (!chunk) {
+		chunk = malloc(sizeof(*chunk));
+		if (!chunk) {
+			return NULL;
+		}
+	}
+	chunk->segment = NULL;
+	chunk->len = 0;
+	return chunk;
+}
+
+static void chunk_release(struct parse_chunk *chunk)
+{
+	if (ring_try_push(chunk_pool, chunk) < 0) {
+		free(chunk);
+	}
+}
+
+static int chunk_check_space(struct ring *r, void **out)
+{
+	return ring_try_push(r, *out) == 0;
+}
+
+static int chunk_check_data(struct ring *r, void **out)
+{
+	*out = ring_try_pop(r);
+	return *out != NULL;
+}
+
+/*
+ * Feed chunks to the parser's auparse state until its ring is
+ * interrupted and empty, aging incomplete events and coalescing windows
+ * every aging_period_ms as the main loop does, then flush what is left.
+ */
+static void *parser_run(void *ptr)
+{
+	struct parser *p = ptr;
+	struct parse_chunk *chunk;
+	long long next_age_ms = 0;
+	long long now_ms;
+	int interrupted;
+	int timeout_ms;
+	char name[16];
+
+	snprintf(name, sizeof(name), "jal-parser-%d", (int)(p - parsers));
+	thread_setup(THREAD_PARSER, name);
+
+	if (stats_acquire() < 0) {
+		// Keep taking chunks so the main thread is not held up
+		// until it stops.
+		syslog(LOG_ERR, "failure allocating parser statistics");
+		status_request(STOP);
+	}
+	for (;;) {
+		// Everything submitted before the interrupt is then sure to
+		// be popped below.
+		interrupted = ring_interrupted(p->chunks);
+		if (!chunk_check_data(p->chunks, (void **)&chunk)) {
+			if (interrupted) {
+				break;
+			}
+			timeout_ms = next_age_ms ? (int)MAX(next_age_ms - monotonic_ms(), 0LL) : -1;
+			ring_wait(p->chunks, &p->chunks->data_waiters, p->chunks->data_fd,
+					timeout_ms, chunk_check_data, (void **)&chunk);
+		}
+		if (!my_stats) {
+			if (chunk) {
+				replay_release(chunk->segment, 1);
+				chunk_release(chunk);
+			}
+			continue;
+		}
+
+		pthread_rwlock_rdlock(&parse_lock);
+		if (chunk) {
+			// Events completed later, by aging, count as part of
+			// the last segment seen.
+			replay_current = chunk->segment;
+			auparse_feed(p->au, chunk->data, chunk->len);
+			replay_release(chunk->segment, 0);
+			chunk_release(chunk);
+		}
+		now_ms = monotonic_ms();
+		if (!auparse_feed_has_data(p->au) && !coalesce_pending(p->tables.coalescer)) {
+			next_age_ms = 0;
+		} else if (!next_age_ms) {
+			next_age_ms = now_ms + aging_period_ms;
+		} else if (now_ms >= next_age_ms) {
+			if (auparse_feed_has_data(p->au)) {
+				auparse_feed_age_events(p->au);
+			}
+			coalesce_expire(p->tables.coalescer, 0);
+			next_age_ms = now_ms + aging_period_ms;
+		}
+		pthread_rwlock_unlock(&parse_lock);
+	}
+	if (my_stats) {
+		pthread_rwlock_rdlock(&parse_lock);
+		auparse_flush_feed(p->au);
+		coalesce_expire(p->tables.coalescer, 1);
+		pthread_rwlock_unlock(&parse_lock);
+	}
+	stats_release(NULL);
+	return NULL;
+}
+
+/*
+ * Hand the parser its pending chunk, waiting for room as long as it
+ * takes: a parser only falls behind by more than its share of the work
+ * while it waits for a full event queue, which overload_policy bounds.
+ */
+static void parse_submit(struct parser *p)
+{
+	while (ring_push(p->chunks, p->pending, 1, chunk_check_space) < 0) {
+		;
+	}
+	p->pending = NULL;
+}
+
+/* Serial number of the event a record line belongs to, or 0. */
+static unsigned long line_serial(const char *line, size_t len)
+{
+	const char *pos = memmem(line, len, "audit(", 6);
+
+	if (!pos) {
+		return 0;
+	}
+	pos = memchr(pos, ':', line + len - pos);
+	if (!pos) {
+		return 0;
+	}
+	// Every line handed in ends with a newline, which stops strtoul().
+	return strtoul(pos + 1, NULL, 10);
+}
+
+/* Append a complete line to the pending chunk of its parser. */
+static void parse_dispatch(const char *line, size_t len)
+{
+	struct parser *p = &parsers[line_serial(line, len) % num_parsers];
+
+	if (p->pending && p->pending->len + len > PARSE_CHUNK_SIZE) {
+		parse_submit(p);
+	}
+	if (!p->pending) {
+		p->pending = chunk_alloc();
+		if (!p->pending) {
+			syslog(LOG_ERR, "failure allocating parser chunk");
+			if (replay_current) {
+				__atomic_store_n(&replay_current->lost, 1, __ATOMIC_RELAXED);
+			}
+			return;
+		}
+		// parse_split() submits every chunk before it returns, so a
+		// chunk holds lines of a single segment.
+		p->pending->segment = replay_current;
+		replay_hold(p->pending->segment);
+	}
+	memcpy(p->pending->data + p->pending->len, line, len);
+	p->pending->len += len;
+}
+
+/*
+ * Split buf into lines for the parsers and submit their chunks. A line
+ * not complete yet is kept for the next call; one that would not fit a
+ * chunk is discarded.
+ */
+static void parse_split(const char *buf, size_t len)
+{
+	const char *end = buf + len;
+	const char *nl;
+	size_t n;
+	int i;
+
+	while (buf < end) {
+		nl = memchr(buf, '\n', end - buf);
+		n = (nl ? nl + 1 : end) - buf;
+		if (split_discard || split_line_len + n > sizeof(split_line)) {
+			if (!split_discard) {
+				syslog(LOG_ERR, "discarding audit record line of more than %d bytes",
+						PARSE_CHUNK_SIZE);
+			}
+			split_discard = !nl;
+			split_line_len = 0;
+		} else if (!nl) {
+			memcpy(split_line + split_line_len, buf, n);
+			split_line_len += n;
+		} else if (split_line_len > 0) {
+			memcpy(split_line + split_line_len, buf, n);
+			parse_dispatch(split_line, split_line_len + n);
+			split_line_len = 0;
+		} else {
+			parse_dispatch(buf, n);
+		}
+		buf += n;
+	}
+	for (i = 0; i < num_parsers; i++) {
+		if (parsers[i].pending) {
+			parse_submit(&parsers[i]);
+		}
+	}
+}
+
+/* Hand input to auparse, or split it among the parsers. */
+static void input_feed(auparse_state_t *au, const char *buf, size_t len)
+{
+	if (num_parsers == 0) {
+		auparse_feed(au, buf, len);
+	} else {
+		parse_split(buf, len);
+	}
+}
+
+/*
+ * Start parser_threads parsers. With just one, the main thread parses
+ * by itself.
+ */
+static int parsers_start(void)
+{
+	pthread_rwlockattr_t attr;
+	struct parser *p;
+	int rc;
+
+	if (parser_threads < 2) {
+		return 0;
+	}
+	chunk_pool = ring_create(PARSE_POOL_SIZE);
+	if (!chunk_pool) {
+		return -1;
+	}
+	// Prefer the writer, or a steady stream of chunks would hold a
+	// reload off indefinitely.
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	rc = pthread_rwlock_init(&parse_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	if (rc != 0) {
+		return -1;
+	}
+	parsers = calloc(parser_threads, sizeof(*parsers));
+	if (!parsers) {
+		pthread_rwlock_destroy(&parse_lock);
+		return -1;
+	}
+
+	while (num_parsers < parser_threads) {
+		p = &parsers[num_parsers];
+		p->au = auparse_init(AUSOURCE_FEED, 0);
+		p->chunks = ring_create(PARSE_QUEUE_LENGTH);
+		if (event_tables_create(&p->tables) < 0 || !p->au || !p->chunks) {
+			goto fail;
+		}
+		auparse_add_callback(p->au, audit_event_handle, &p->tables, NULL);
+		if (pthread_create(&p->thread, NULL, parser_run, p) != 0) {
+			goto fail;
+		}
+		num_parsers++;
+	}
+	return 0;
+fail:
+	if (p->au) {
+		auparse_destroy(p->au);
+	}
+	event_tables_destroy(&p->tables);
+	ring_destroy(&p->chunks);
+	return -1;
+}
+
+/*
+ * Pass on the input held by the main thread, let every parser work
+ * through its chunks and flush its auparse state, and join them.
+ */
+static void parsers_stop(void)
+{
+	struct parse_chunk *chunk;
+	int i;
+
+	if (!parsers) {
+		goto out;
+	}
+	if (num_parsers > 0 && split_line_len > 0 && !split_discard) {
+		parse_dispatch(split_line, split_line_len);
+	}
+	split_line_len = 0;
+	for (i = 0; i < num_parsers; i++) {
+		if (parsers[i].pending) {
+			parse_submit(&parsers[i]);
+		}
+		ring_interrupt(parsers[i].chunks, 1);
+	}
+	for (i = 0; i < num_parsers; i++) {
+		pthread_join(parsers[i].thread, NULL);
+		auparse_destroy(parsers[i].au);
+		event_tables_destroy(&parsers[i].tables);
+		ring_destroy(&parsers[i].chunks);
+	}
+	pthread_rwlock_destroy(&parse_lock);
+	free(parsers);
+	parsers = NULL;
+	num_parsers = 0;
+out:
+	if (chunk_pool) {
+		while ((chunk = ring_try_pop(chunk_pool))) {
+			free(chunk);
+		}
+		ring_destroy(&chunk_pool);
+	}
+}
+
+/* Keep the parsers out of the filters and the queue, or let them back in. */
+static void parsers_pause(int on)
+{
+	if (num_parsers == 0) {
+		return;
+	}
+	if (on) {
+		pthread_rwlock_wrlock(&parse_lock);
+	} else {
+		pthread_rwlock_unlock(&parse_lock);
+	}
+}
+
+/*
+ * Block SIGHUP and SIGTERM, to be read from signal_fd instead, and set up
+ * the main loop's epoll instance. Must run before any thread is created
+ * so that every thread inherits the signal mask.
+ */
+static int input_open(void)
+{
+	struct epoll_event ev;
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGTERM);
+	if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0) {
+		return -1;
+	}
+	signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (signal_fd < 0 || wake_fd < 0 || timer_fd < 0 || epoll_fd < 0) {
+		return -1;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = signal_fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &ev) < 0) {
+		return -1;
+	}
+	ev.data.fd = wake_fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) < 0) {
+		return -1;
+	}
+	ev.data.fd = timer_fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/* Join the kernel's audit multicast group. */
+static int netlink_open(void)
+{
+	struct sockaddr_nl addr;
+	int size = NETLINK_RCVBUF;
+	int fd;
+
+	netlink_buffers = malloc(NETLINK_BATCH * sizeof(*netlink_buffers));
+	if (!netlink_buffers) {
+		return -1;
+	}
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_AUDIT);
+	if (fd < 0) {
+		return -1;
+	}
+	// Only root may go past rmem_max; settle for that otherwise.
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0) {
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1 << (AUDIT_NLGRP_READLOG - 1);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
 
-		log_data = jalp_logger_metadata_create();
-		if (!log_data) {
-			syslog(LOG_ERR, "failure creating JALP logger metadata");
-			goto out;
-		}
+/*
+ * Add the configured input to the epoll set. A regular file on stdin,
+ * which epoll refuses, is always readable, and so are the files of a
+ * replay.
+ */
+static int input_attach(void)
+{
+	struct epoll_event ev;
 
-		log_data->logger_name = strdup("auditd");
-		if (!log_data->logger_name) {
-			syslog(LOG_ERR, "failure strduping logger_name");
-			goto out;
+	if (replay) {
+		input_source = INPUT_REPLAY;
+		stdin_polled = 0;
+		return 0;
+	}
+	if (input_mode == INPUT_NETLINK) {
+		input_fd = netlink_open();
+		if (input_fd < 0) {
+			return -1;
 		}
+	}
+	input_source = input_mode;
 
-		log_data->sd = jalp_structured_data_append(NULL, "audit");
-		if (!log_data->sd) {
-			syslog(LOG_ERR, "failure appending JALP audit structured data");
-			goto out;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = input_fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, input_fd, &ev) < 0) {
+		if (errno != EPERM || input_source != INPUT_STDIN) {
+			return -1;
 		}
+		stdin_polled = 0;
+	}
+	return 0;
+}
 
-		app_data->log = log_data;
-
-		do {
-			const char *key = auparse_get_field_name(au);
-			const char *value = auparse_get_field_str(au);
+/*
+ * Receive a batch of netlink messages and feed them to auparse in the
+ * text format of audispd. Returns 0 on success and -1 on failure.
+ */
+static int netlink_read(auparse_state_t *au)
+{
+	struct mmsghdr msgs[NETLINK_BATCH];
+	struct iovec iov[NETLINK_BATCH];
+	struct nlmsghdr *nh;
+	const char *name;
+	const char *data;
+	size_t used = 0;
+	size_t size;
+	int len;
+	int n;
+	int i;
 
-			if (0 == strcmp(key,"type") && 0 == strcmp(value,"EOE")) {
-				goto out;
-			}	
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < NETLINK_BATCH; i++) {
+		iov[i].iov_base = netlink_buffers[i];
+		iov[i].iov_len = sizeof(netlink_buffers[i]);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	n = recvmmsg(input_fd, msgs, NETLINK_BATCH, MSG_DONTWAIT, NULL);
+	if (n < 0) {
+		if (errno == ENOBUFS) {
+			STAT_INC(input_overruns);
+			return 0;
+		}
+		return errno == EAGAIN || errno == EINTR ? 0 : -1;
+	}
+	STAT_INC(input_reads);
 
-			param = jalp_param_append(param, key, value);
-			if (!param) {
-				syslog(LOG_ERR, "failure appending JALP parameter: %s %s", key, value);
-				goto out;
+	for (i = 0; i < n; i++) {
+		size = msgs[i].msg_len;
+		STAT_ADD(input_bytes, size);
+		for (nh = (struct nlmsghdr *)netlink_buffers[i]; NLMSG_OK(nh, size);
+				nh = NLMSG_NEXT(nh, size)) {
+			if (nh->nlmsg_type < NLMSG_MIN_TYPE) {
+				// NLMSG_NOOP, NLMSG_ERROR and the like
+				continue;
 			}
-
-			if (!param_list) {
-				param_list = param;
+			data = NLMSG_DATA(nh);
+			len = nh->nlmsg_len - NLMSG_HDRLEN;
+			while (len > 0 && (data[len - 1] == '\0' || data[len - 1] == '\n')) {
+				len--;
 			}
-		} while (auparse_next_field(au) > 0);
-
-		log_data->sd->param_list = param_list;
-		log_data->message = strdup(auparse_get_record_text(au));
-		if (!log_data->message) {
-			syslog(LOG_ERR, "failure retrieving auparse record text");
-			goto out;
-		}
-		pthread_mutex_lock(&queue_mutex);
-		
-		while (g_queue_get_length(event_queue) >= (unsigned int)queue_max_length){
-			clock_gettime(CLOCK_REALTIME, &timeout);
-			timeout.tv_sec+=QUEUE_FULL_TIMEOUT;
-			errno=0;
-			pthread_cond_timedwait(&queue_full, &queue_mutex, &timeout);
-			if (g_queue_get_length(event_queue) >= (unsigned int)queue_max_length){
-				// We woke up, but the queue is still full. Discard message
-				pthread_mutex_unlock(&queue_mutex);
-				goto out;
+			if (INPUT_BUFFER_SIZE - used < (size_t)len + 64) {
+				input_feed(au, input_buffer, used);
+				used = 0;
+			}
+			name = audit_msg_type_to_name(nh->nlmsg_type);
+			if (name) {
+				used += snprintf(input_buffer + used, INPUT_BUFFER_SIZE - used,
+						"type=%s msg=%.*s\n", name, len, data);
+			} else {
+				used += snprintf(input_buffer + used, INPUT_BUFFER_SIZE - used,
+						"type=UNKNOWN[%d] msg=%.*s\n", nh->nlmsg_type, len, data);
 			}
 		}
-		g_queue_push_tail(event_queue, (void*)app_data);
-
-		queue_max_length_seen = MAX(g_queue_get_length(event_queue),queue_max_length_seen);
-		pthread_mutex_unlock(&queue_mutex);
-		pthread_cond_signal(&data_in_queue);
-
-		app_data = NULL;
-		log_data = NULL;
-		param_list = NULL;
-		param = NULL;
-	} while (auparse_next_record(au) > 0);
-	return;
-out:
-	jalp_app_metadata_destroy(&app_data);
+	}
+	if (used > 0) {
+		input_feed(au, input_buffer, used);
+	}
+	return 0;
 }
 
-static int config_load(config_t *config)
+/*
+ * Look up the files to replay and, with a checkpoint, where each was
+ * left. Files are told apart by device and inode, so a checkpoint still
+ * applies if they were renamed by a rotation in the meantime.
+ */
+static int replay_init(char **paths, int count)
 {
-	int rc = 0;
+	struct stat st;
+	char line[REPLAY_LINE_MAX];
+	unsigned long dev;
+	unsigned long ino;
+	long long offset;
+	int done;
+	FILE *fp;
+	int i;
 
-	if (!config) {
-		rc = -1;
-		goto out;
+	replay_files = calloc(count, sizeof(*replay_files));
+	replay_buffer = malloc(REPLAY_SEGMENT_SIZE + 1);
+	if (!replay_files || !replay_buffer) {
+		syslog(LOG_ERR, "failure allocating replay buffers");
+		return -1;
 	}
+	for (i = 0; i < count; i++) {
+		if (stat(paths[i], &st) < 0) {
+			syslog(LOG_ERR, "failure opening %s: %s", paths[i], strerror(errno));
+			return -1;
+		}
+		replay_files[i].path = paths[i];
+		replay_files[i].dev = st.st_dev;
+		replay_files[i].ino = st.st_ino;
+	}
+	replay_count = count;
 
-	rc = config_read_file(config, CONFIG_PATH);
-	if (rc != CONFIG_TRUE) {
-		syslog(LOG_ERR, "failure reading config file, rc: %d, %s, line: %d", rc,
-						config_error_text(config),
-						config_error_line(config));
-		goto out;
+	if (!replay_checkpoint_path) {
+		return 0;
 	}
-#if defined(LIBCONFIG_VER_MAJOR) \
-	&& (((LIBCONFIG_VER_MAJOR == 1) && (LIBCONFIG_VER_MINOR >= 4)) \
-	|| (LIBCONFIG_VER_MAJOR > 1))
-	config_lookup_int(config,PRINTSTATS, &print_stats);
-	config_lookup_int(config,PRINTSTATSFREQ, &print_stats_freq);
-	config_lookup_int(config,QUEUEMAXLENGTH, &queue_max_length);
-#else
-	long print_stats_long = print_stats;
-	long print_stats_freq_long = print_stats_freq;
-	long queue_max_length_long = queue_max_length;
-	config_lookup_int(config,PRINTSTATS, &print_stats_long);
-	config_lookup_int(config,PRINTSTATSFREQ, &print_stats_freq_long);
-	config_lookup_int(config,QUEUEMAXLENGTH, &queue_max_length_long);
-	if(print_stats_long > INT_MAX){
-		syslog(LOG_ERR, "print_stats in config file is too big.  Using default value");
-	}else{
-		print_stats = (int)print_stats_long;
+	fp = fopen(replay_checkpoint_path, "r");
+	if (!fp) {
+		if (errno == ENOENT) {
+			return 0;
+		}
+		syslog(LOG_ERR, "failure opening checkpoint %s: %s", replay_checkpoint_path,
+				strerror(errno));
+		return -1;
 	}
-	if(print_stats_freq_long > INT_MAX){
-		syslog(LOG_ERR, "print_stats_freq in config file is too big.  Using default value");
-	}else{
-		print_stats_freq = (int)print_stats_freq_long;
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%lu %lu %lld %d", &dev, &ino, &offset, &done) != 4 ||
+				offset < 0) {
+			continue;
+		}
+		for (i = 0; i < count; i++) {
+			if (replay_files[i].dev == (dev_t)dev && replay_files[i].ino == (ino_t)ino) {
+				replay_files[i].offset = offset;
+				replay_files[i].done = done;
+			}
+		}
 	}
-	if(queue_max_length_long > INT_MAX){
-		syslog(LOG_ERR, "queue_max_length in config file is too big.  Using default value");
-	}else{
-		queue_max_length = (int)queue_max_length_long;
+	fclose(fp);
+	return 0;
+}
+
+static void replay_close(void)
+{
+	if (replay_map) {
+		munmap(replay_map, replay_map_len);
+		replay_map = NULL;
+		replay_map_len = 0;
+	}
+	if (replay_gz) {
+		gzclose(replay_gz);
+		replay_gz = NULL;
 	}
+	if (replay_fd >= 0) {
+		close(replay_fd);
+		replay_fd = -1;
+	}
+	replay_used = 0;
+	replay_carry = 0;
+	replay_reading = 0;
+}
 
-#endif
+/*
+ * Open a file to replay from its checkpoint offset, which counts
+ * uncompressed bytes: a mapping for a plain file or a gzip stream.
+ */
+static int replay_open(struct replay_file *file)
+{
+	unsigned char magic[2];
+	struct stat st;
 
-out:
-	return rc;
+	replay_fd = open(file->path, O_RDONLY | O_CLOEXEC);
+	if (replay_fd < 0 || fstat(replay_fd, &st) < 0) {
+		return -1;
+	}
+	replay_reading = 1;
+	replay_pos = file->offset;
+	if (pread(replay_fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+			magic[0] == 0x1f && magic[1] == 0x8b) {
+		replay_gz = gzdopen(replay_fd, "rb");
+		if (!replay_gz) {
+			return -1;
+		}
+		// gzclose() closes it now.
+		replay_fd = -1;
+		gzbuffer(replay_gz, 256 * 1024);
+		if (file->offset > 0 && gzseek(replay_gz, file->offset, SEEK_SET) < 0) {
+			return -1;
+		}
+	} else if (st.st_size > file->offset) {
+		replay_map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, replay_fd, 0);
+		if (replay_map == MAP_FAILED) {
+			replay_map = NULL;
+			return -1;
+		}
+		replay_map_len = st.st_size;
+		madvise(replay_map, replay_map_len, MADV_SEQUENTIAL);
+	}
+	syslog(LOG_INFO, "replaying %s from offset %lld", file->path, (long long)file->offset);
+	return 0;
 }
 
-static int context_init(config_t *config, jalp_context *ctx)
+/*
+ * Point *data at the next segment of the open file, up to
+ * REPLAY_SEGMENT_SIZE bytes ending with a newline unless a line is
+ * longer than that or the file ends without one. Returns its length, 0
+ * at the end of the file or -1 on failure.
+ */
+static ssize_t replay_segment_read(const char **data)
 {
-	int rc = 0;
-	const char *sockpath = NULL;
-	const char *schemas = NULL;
-	const char *keypath = NULL;
-	const char *certpath = NULL;
+	const char *nl;
+	size_t len;
+	int got;
 
-	if (!config) {
-		rc = -1;
-		goto out;
+	if (replay_map) {
+		len = MIN(replay_map_len - (size_t)replay_pos, (size_t)REPLAY_SEGMENT_SIZE);
+		*data = replay_map + replay_pos;
+		if ((size_t)replay_pos + len < replay_map_len &&
+				(nl = memrchr(*data, '\n', len))) {
+			len = nl + 1 - *data;
+		}
+		return len;
+	}
+	if (!replay_gz) {
+		// Nothing left of a plain file
+		return 0;
 	}
 
-	config_lookup_string(config, SOCKET, &sockpath);
-	config_lookup_string(config, SCHEMAS, &schemas);
-	config_lookup_string(config, KEYPATH, &keypath);
-	config_lookup_string(config, CERTPATH, &certpath);
+	// Keep the incomplete line the last segment ended with.
+	memmove(replay_buffer, replay_buffer + replay_used, replay_carry);
+	got = gzread(replay_gz, replay_buffer + replay_carry,
+			REPLAY_SEGMENT_SIZE - replay_carry);
+	if (got < 0) {
+		errno = EIO;
+		return -1;
+	}
+	len = replay_carry + got;
+	*data = replay_buffer;
+	if (got == 0) {
+		if (len > 0 && replay_buffer[len - 1] != '\n') {
+			replay_buffer[len++] = '\n';
+		}
+		replay_used = len;
+		replay_carry = 0;
+		return len;
+	}
+	nl = memrchr(replay_buffer, '\n', len);
+	replay_used = nl ? (size_t)(nl + 1 - replay_buffer) : len;
+	replay_carry = len - replay_used;
+	return replay_used;
+}
 
-	rc = jalp_context_init(ctx, sockpath, NULL, "auditd", schemas);
+/*
+ * Write where to resume to the checkpoint, replacing it atomically.
+ * That is the start of the segment before the first one not entirely
+ * sent, or past every file once the replay finished with nothing left
+ * in flight.
+ */
+static void replay_checkpoint(void)
+{
+	char path[PATH_MAX];
+	struct replay_segment *seg;
+	struct replay_segment *resume = NULL;
+	struct replay_file *file;
+	int complete;
+	int done;
+	FILE *fp;
+	int i;
 
-	if (rc != JAL_OK) {
-		goto out;
+	replay_saved_ms = monotonic_ms();
+	if (!replay_checkpoint_path) {
+		return;
+	}
+	for (seg = replay_head; seg; seg = seg->next) {
+		if (!seg->fed || __atomic_load_n(&seg->outstanding, __ATOMIC_ACQUIRE) > 0 ||
+				__atomic_load_n(&seg->lost, __ATOMIC_RELAXED)) {
+			break;
+		}
+		resume = seg;
+	}
+	complete = !seg && replay_finished;
+	if (seg && !resume) {
+		resume = seg;
 	}
 
-	if (keypath != NULL) {
-		rc = jalp_context_load_pem_rsa(ctx, keypath, NULL);
-		if (rc != JAL_OK) {
-			goto out;
+	snprintf(path, sizeof(path), "%s.tmp", replay_checkpoint_path);
+	fp = fopen(path, "w");
+	if (!fp) {
+		goto fail;
+	}
+	for (i = 0; i < replay_count; i++) {
+		file = &replay_files[i];
+		done = file->done || complete || (resume && i < resume->file);
+		fprintf(fp, "%lu %lu %lld %d %s\n", (unsigned long)file->dev,
+				(unsigned long)file->ino,
+				done ? 0 : resume && i == resume->file ?
+				(long long)resume->start : (long long)file->offset,
+				done, file->path);
+	}
+	if (fflush(fp) != 0 || fsync(fileno(fp)) < 0) {
+		fclose(fp);
+		goto fail;
+	}
+	if (fclose(fp) != 0 || rename(path, replay_checkpoint_path) < 0) {
+		goto fail;
+	}
+	replay_save_failed = 0;
+	return;
+fail:
+	if (!replay_save_failed) {
+		syslog(LOG_ERR, "failure writing checkpoint %s: %s", replay_checkpoint_path,
+				strerror(errno));
+	}
+	replay_save_failed = 1;
+}
+
+/*
+ * Feed the next segment of the files being replayed, and save the
+ * checkpoint when it is due. Returns 1 if there was one, 0 once every
+ * file has been read and -1 on failure.
+ */
+static int replay_read(auparse_state_t *au)
+{
+	struct replay_segment *seg;
+	struct replay_file *file;
+	const char *data = NULL;
+	ssize_t len = 0;
+
+	while (replay_index < replay_count) {
+		file = &replay_files[replay_index];
+		if (!file->done) {
+			if (!replay_reading && replay_open(file) < 0) {
+				syslog(LOG_ERR, "failure opening %s: %s", file->path, strerror(errno));
+				return -1;
+			}
+			len = replay_segment_read(&data);
+			if (len < 0) {
+				syslog(LOG_ERR, "failure reading %s: %s", file->path, strerror(errno));
+				return -1;
+			}
+			if (len > 0) {
+				break;
+			}
+			replay_close();
 		}
+		replay_index++;
+	}
+	if (replay_index == replay_count) {
+		syslog(LOG_INFO, "read all of %d replayed files", replay_count);
+		replay_finished = 1;
+		return 0;
 	}
 
-	if (certpath != NULL) {
-		rc = jalp_context_load_pem_cert(ctx, certpath);
+	seg = calloc(1, sizeof(*seg));
+	if (!seg) {
+		syslog(LOG_ERR, "failure allocating replay segment");
+		return -1;
+	}
+	seg->file = replay_index;
+	seg->start = replay_pos;
+	if (replay_tail) {
+		replay_tail->next = seg;
+	} else {
+		replay_head = seg;
 	}
+	replay_tail = seg;
+	replay_pos += len;
 
-out:
-	return rc;
-}
+	STAT_INC(input_reads);
+	STAT_ADD(input_bytes, len);
+	replay_current = seg;
+	input_feed(au, data, len);
+	seg->fed = 1;
 
-static void* log_stats(void* ptr){
-	UNUSED(ptr);
-	while(1){
-		sleep(print_stats_freq);
-		syslog(LOG_INFO, "Max queue length seen: %d", queue_max_length_seen);
-		syslog(LOG_INFO, "Current queue length: %d", g_queue_get_length(event_queue));
+	if (monotonic_ms() - replay_saved_ms >= REPLAY_CHECKPOINT_MS) {
+		replay_checkpoint();
 	}
-	return NULL;
+	return 1;
 }
 
-static void* send_messages_to_local_store(void* ctx)
+/*
+ * Once everything is read, wait for the senders to empty the queue for
+ * as long as it takes, unless told to stop or no sender is left.
+ */
+static void replay_drain(void)
 {
-	int rc=0;	
-	struct jalp_app_metadata *app_data = NULL;
-
-	// Create a dummy payload to include in each JALoP Audit Record
-	// because an audit record cannot have an empty payload, unlike
-	// a log record. Note that the application metadata includes
-	// the original auditd message plus each key/value pair extracted
-	// from the message in the "StructuredData" node of app metadata.
-	const char *payload_str = "see app-meta";
-	uint8_t* payload = NULL;
-	size_t payload_size = strlen(payload_str);
-	payload = calloc(1, sizeof(char)*payload_size);
-	memcpy(payload, payload_str, payload_size);
+	struct timespec pause = { 0, 100 * 1000 * 1000 };
 
-	while(1){
-		pthread_mutex_lock(&queue_mutex);
-		while(g_queue_is_empty(event_queue)){
-			pthread_cond_wait(&data_in_queue, &queue_mutex);
+	while (queue_length() > 0 &&
+			__atomic_load_n(&senders_running, __ATOMIC_SEQ_CST) > 0 &&
+			status_get() != STOP) {
+		nanosleep(&pause, NULL);
+		input_signals();
+		if (monotonic_ms() - replay_saved_ms >= REPLAY_CHECKPOINT_MS) {
+			replay_checkpoint();
 		}
+	}
+}
+
+static void replay_destroy(void)
+{
+	struct replay_segment *seg;
 
-		app_data = (struct jalp_app_metadata*) g_queue_pop_head(event_queue);
+	replay_close();
+	while (replay_head) {
+		seg = replay_head;
+		replay_head = seg->next;
+		free(seg);
+	}
+	replay_tail = NULL;
+	free(replay_files);
+	replay_files = NULL;
+	free(replay_buffer);
+	replay_buffer = NULL;
+}
 
-		pthread_mutex_unlock(&queue_mutex);
-		pthread_cond_signal(&queue_full);
+static void input_close(void)
+{
+	if (epoll_fd >= 0) {
+		close(epoll_fd);
+		epoll_fd = -1;
+	}
+	if (signal_fd >= 0) {
+		close(signal_fd);
+		signal_fd = -1;
+	}
+	if (wake_fd >= 0) {
+		close(wake_fd);
+		wake_fd = -1;
+	}
+	if (timer_fd >= 0) {
+		close(timer_fd);
+		timer_fd = -1;
+	}
+	if (input_source == INPUT_NETLINK && input_fd >= 0) {
+		close(input_fd);
+		input_fd = 0;
+	}
+	free(netlink_buffers);
+	netlink_buffers = NULL;
+}
 
-		rc = jalp_audit((jalp_context*) ctx, app_data, payload, payload_size);
+/*
+ * Run the aging timer every aging_period_ms while on is set, and stop it
+ * otherwise. The timer is only reprogrammed when that changes anything.
+ */
+static void input_aging(int on)
+{
+	struct itimerspec its;
+	int period_ms = on ? aging_period_ms : 0;
 
-		free(app_data->log->message);
-		app_data->log->message = NULL;
+	if (period_ms == aging_armed_ms) {
+		return;
+	}
+	memset(&its, 0, sizeof(its));
+	its.it_interval.tv_sec = period_ms / 1000;
+	its.it_interval.tv_nsec = (long)(period_ms % 1000) * 1000000;
+	its.it_value = its.it_interval;
+	if (timerfd_settime(timer_fd, 0, &its, NULL) < 0) {
+		syslog(LOG_ERR, "failure setting aging timer: %s", strerror(errno));
+		return;
+	}
+	aging_armed_ms = period_ms;
+}
 
-		jalp_param_destroy(&(app_data->log->sd->param_list));
-		app_data->log->sd->param_list = NULL;
-		jalp_app_metadata_destroy(&app_data);
+/*
+ * Wait for input, handling signals and wakeups on the way. Returns
+ * INPUT_READABLE if stdin is readable, INPUT_AGING if the aging timer
+ * expired, both, none (0) or -1 on failure.
+ */
+static int input_wait(void)
+{
+	struct epoll_event events[4];
+	uint64_t token;
+	int ready = stdin_polled ? 0 : INPUT_READABLE;
+	int n;
+	int i;
 
-		if (rc != JAL_OK) {
-			syslog(LOG_ERR, "failure sending JALP audit message, rc: %d", rc);	
-			status = RELOAD;
-			return NULL;
+	n = epoll_wait(epoll_fd, events, 4, ready ? 0 : -1);
+	if (n < 0) {
+		return errno == EINTR ? 0 : -1;
+	}
+	for (i = 0; i < n; i++) {
+		if (events[i].data.fd == input_fd) {
+			ready |= INPUT_READABLE;
+		} else if (events[i].data.fd == signal_fd) {
+			input_signals();
+		} else if (events[i].data.fd == timer_fd) {
+			if (read(timer_fd, &token, sizeof(token)) == sizeof(token)) {
+				ready |= INPUT_AGING;
+			}
+		} else if (read(wake_fd, &token, sizeof(token)) < 0 && errno != EAGAIN) {
+			syslog(LOG_ERR, "failure reading main loop wakeup: %s", strerror(errno));
 		}
 	}
-	if (payload) free(payload);
-	return NULL;
+	return ready;
 }
 
-int main(void)
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-c config]\n"
+			"       %s [-c config] [-k checkpoint] -r file...\n", prog, prog);
+}
+
+int main(int argc, char **argv)
 {
 	int rc = 0;
-	char msg[MAX_AUDIT_MESSAGE_LENGTH+1];
+	int opt;
 	auparse_state_t *au = NULL;
-	jalp_context *ctx = NULL;
-	event_queue = g_queue_new();
+	struct event_tables tables = { NULL, NULL };
+	struct sender *senders = NULL;
+	int num_senders = 0;
+	struct connection_config connection;
 	config_t config;
-	pthread_t send_ls_thread;
 	pthread_t print_stats_thread;
+	int stats_running = 0;
+
+	while ((opt = getopt(argc, argv, "c:k:r")) != -1) {
+		switch (opt) {
+		case 'c':
+			config_path = optarg;
+			break;
+		case 'k':
+			replay_checkpoint_path = optarg;
+			break;
+		case 'r':
+			replay = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (replay != (optind < argc) || (replay_checkpoint_path && !replay)) {
+		usage(argv[0]);
+		return 1;
+	}
 
 	config_init(&config);
+	memset(&connection, 0, sizeof(connection));
 
-	signal(SIGTERM, sig_handle);
-	signal(SIGHUP, sig_handle);
+	rc = input_open();
+	if (rc < 0) {
+		syslog(LOG_ERR, "failure setting up input: %s", strerror(errno));
+		goto out;
+	}
 
 	rc = jalp_init();
 	if (rc != JAL_OK) {
@@ -358,115 +6343,270 @@ int main(void)
 		goto out;
 	}
 
+	rc = intern_init();
+	if (rc < 0) {
+		syslog(LOG_ERR, "failure creating interned key table");
+		goto out;
+	}
+
+	rc = stats_acquire();
+	if (rc < 0) {
+		syslog(LOG_ERR, "failure allocating statistics");
+		goto out;
+	}
+
+	if (replay) {
+		rc = replay_init(argv + optind, argc - optind);
+		if (rc < 0) {
+			goto out;
+		}
+	}
+
 	/* Set STDIN non-blocking */
 	fcntl(0, F_SETFL, O_NONBLOCK);
 
 	au = auparse_init(AUSOURCE_FEED, 0);
-	if (!au) {
+	if (event_tables_create(&tables) < 0 || !au) {
 		rc = -1;
 		syslog(LOG_ERR, "failure initializing auparse");
 		goto out;
 	}
 
-	auparse_add_callback(au, audit_event_handle, NULL, NULL);
+	auparse_add_callback(au, audit_event_handle, &tables, NULL);
 
 	do 
 	{
-		fd_set read_mask;
-		int read_size = 1; /* Set to 1 so it's not EOF */
+		ssize_t read_size;
+		int ready;
 
-		if (status == RELOAD || !ctx) 
+		if (status_get() == RELOAD || !senders) 
 		{
+			struct connection_config new_connection;
+			int rebuild;
+			int resize = 0;
+			int reload = RELOAD;
+
+			// A send failure while reloading asks for another reload.
+			__atomic_compare_exchange_n(&status, &reload, RUN, 0,
+					__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+			if (senders) 
+			{
+				STAT_INC(reloads);
+			}
 			syslog(LOG_INFO, "loading config");
 
+			parsers_pause(1);
 			rc = config_load(&config);
+			parsers_pause(0);
 			if (rc < 0) 
 			{
 				syslog(LOG_ERR, "failure reloading config, rc: %d", rc);
 				goto out;
 			}
+			thread_setup(THREAD_INPUT, NULL);
+			connection_load(&config, &new_connection);
+			config_destroy(&config);
+			rebuild = senders && !connection_equal(&connection, &new_connection);
+			connection_free(&connection);
+			connection = new_connection;
 
-			jalp_context_destroy(&ctx);
-
-			ctx = jalp_context_create();
-			if (!ctx) 
+			if (!event_lanes[LANE_NORMAL]) 
 			{
-				rc = -1;
-				syslog(LOG_ERR, "failure creating JALP context");
-				goto out;
+				if (queue_create(event_lanes, queue_max_length) < 0) 
+				{
+					rc = -1;
+					syslog(LOG_ERR, "failure creating event queue");
+					goto out;
+				}
+				record_pool = ring_create(RECORD_POOL_SIZE);
+				if (!record_pool) 
+				{
+					rc = -1;
+					syslog(LOG_ERR, "failure creating record pool");
+					goto out;
+				}
+				if (spool_dir && spool_open(spool_dir) < 0) 
+				{
+					rc = -1;
+					syslog(LOG_ERR, "failure opening spool %s", spool_dir);
+					goto out;
+				}
+				if (input_attach() < 0) 
+				{
+					rc = -1;
+					syslog(LOG_ERR, "failure opening input: %s", strerror(errno));
+					goto out;
+				}
+				if (parsers_start() < 0) 
+				{
+					rc = -1;
+					syslog(LOG_ERR, "failure starting %d parser threads", parser_threads);
+					goto out;
+				}
+			} 
+			else 
+			{
+				resize = (unsigned long)queue_max_length !=
+						event_lanes[LANE_NORMAL]->capacity;
+				if (!string_equal(spool ? spool->path : NULL, spool_dir)) 
+				{
+					syslog(LOG_INFO, "spool_dir change takes effect on restart");
+				}
+				if (input_source != INPUT_REPLAY && input_mode != input_source) 
+				{
+					syslog(LOG_INFO, "input change takes effect on restart");
+				}
+				if ((parser_threads < 2 ? 0 : parser_threads) != num_parsers) 
+				{
+					syslog(LOG_INFO, "parser_threads change takes effect on restart");
+				}
 			}
 
-			rc = context_init(&config, ctx);
-			if (rc < 0) 
+			// Everything that reads the queue has to stop while it
+			// is replaced; otherwise only what changed is restarted.
+			if (resize || exporter_changed()) 
 			{
-				syslog(LOG_ERR, "failure resetting JALP context, rc: %d", rc);
-				goto out;
+				exporter_stop();
 			}
-			config_destroy(&config);
-			if (status == RELOAD) 
+			if (stats_running && (resize || !print_stats)) 
+			{
+				pthread_cancel(print_stats_thread);
+				pthread_join(print_stats_thread, NULL);
+				stats_running = 0;
+			}
+			if (resize) 
 			{
-				if (print_stats) 
+				senders_stop(senders, num_senders,
+						monotonic_ms() + (long long)drain_timeout * 1000);
+				parsers_pause(1);
+				if (queue_resize(queue_max_length) < 0) 
 				{
-					pthread_cancel(print_stats_thread);
+					syslog(LOG_ERR, "failure resizing event queue");
 				}
-				pthread_cancel(send_ls_thread);
+				parsers_pause(0);
+			}
+
+			rc = senders_update(&senders, &num_senders, &connection, rebuild);
+			if (rc < 0) 
+			{
+				goto out;
 			}
-			pthread_create(&send_ls_thread, NULL, &send_messages_to_local_store, (void*)ctx);
-			if (print_stats)
+			if (rebuild) 
 			{
-				pthread_create(&print_stats_thread, NULL, &log_stats, NULL);
+				syslog(LOG_INFO, "JALoP context settings changed, contexts rebuilt");
 			}
 
-			status = RUN;
-		}
-		do 
-		{
-			FD_ZERO(&read_mask);
-			FD_SET(0, &read_mask);
-
-			if (auparse_feed_has_data(au)) 
+			if (!exporter_running && exporter_changed()) 
 			{
-				/* If there are any records, do a fast time
-				 * out so we can age out the data so it doesn't
-				 * get stuck inside auparse. */
-				struct timeval tv;
-				tv.tv_sec = 1;
-				tv.tv_usec = 0;
-				rc = select(1, &read_mask, NULL, NULL, &tv);
-			} 
-			else	/* no data, wait forever */
+				exporter_start();
+			}
+			if (print_stats && !stats_running)
 			{
-				rc = select(1, &read_mask, NULL, NULL, NULL);
+				stats_running = pthread_create(&print_stats_thread, NULL, &log_stats, NULL) == 0;
 			}
+		}
+		/* If there are any records, run the aging timer so the
+		 * data doesn't get stuck inside auparse or the coalescing
+		 * table; with no data, wait for input alone. */
+		input_aging(auparse_feed_has_data(au) || coalesce_pending(tables.coalescer));
+		ready = input_wait();
+		if (ready < 0) 
+		{
+			rc = -1;
+			syslog(LOG_ERR, "failure waiting for input: %s", strerror(errno));
+			break;
+		}
+
+		/* If the timer expired & we have events, shake them loose */
+		if ((ready & INPUT_AGING) && auparse_feed_has_data(au))
+		{
+			auparse_feed_age_events(au);
+		}
+		if (ready & INPUT_AGING)
+		{
+			coalesce_expire(tables.coalescer, 0);
+		}
 
-			/* If we timed out & have events, shake them loose */
-			if (rc == 0 && auparse_feed_has_data(au))
+		/* The event loop. One read per wakeup, so signals are
+		 * still seen while the input never runs dry. */
+		if (status_get() == RUN && (ready & INPUT_READABLE) &&
+				input_source == INPUT_REPLAY) 
+		{
+			rc = replay_read(au);
+			if (rc <= 0) 
 			{
-				auparse_feed_age_events(au);
+				break;
 			}
-
-		} while (rc == -1 && errno == EINTR && status == RUN);
-		/* The event loop */
-		if (status == RUN && rc > 0) 
+			rc = 0;
+		}
+		else if (status_get() == RUN && (ready & INPUT_READABLE) &&
+				input_source == INPUT_NETLINK) 
 		{
-			while ((read_size = read(0, msg, MAX_AUDIT_MESSAGE_LENGTH)) > 0)
+			if (netlink_read(au) < 0) 
 			{
-				auparse_feed(au, msg, read_size);
+				rc = -1;
+				syslog(LOG_ERR, "failure reading audit netlink socket: %s",
+						strerror(errno));
+				break;
 			}
 		}
-		if (read_size == 0)  /* EOF */
+		else if (status_get() == RUN && (ready & INPUT_READABLE)) 
 		{
-			rc = 0;
-			break;
+			read_size = read(0, input_buffer, sizeof(input_buffer));
+			if (read_size > 0)
+			{
+				STAT_INC(input_reads);
+				STAT_ADD(input_bytes, read_size);
+				input_feed(au, input_buffer, read_size);
+			}
+			else if (read_size == 0)  /* EOF */
+			{
+				rc = 0;
+				break;
+			}
 		}
-	} while (status == RUN || status == RELOAD);
+	} while (status_get() == RUN || status_get() == RELOAD);
 
 	auparse_flush_feed(au);
+	coalesce_expire(tables.coalescer, 1);
 out:
-	jalp_context_destroy(&ctx);
+	parsers_stop();
+	if (event_lanes[LANE_NORMAL]) {
+		long long deadline_ms;
+
+		if (replay_finished) {
+			replay_drain();
+		}
+		deadline_ms = monotonic_ms() + (long long)drain_timeout * 1000;
+		queue_drain(deadline_ms);
+		senders_stop(senders, num_senders, deadline_ms);
+		queue_persist();
+	}
+	if (replay_count > 0) {
+		replay_checkpoint();
+	}
+	exporter_stop();
+	if (stats_running) {
+		pthread_cancel(print_stats_thread);
+		pthread_join(print_stats_thread, NULL);
+	}
+	senders_destroy(senders, num_senders);
+	connection_free(&connection);
 	jalp_shutdown();
 	if (au) {
 		auparse_destroy(au);
 	}
+	event_tables_destroy(&tables);
+	spool_close();
+	input_close();
+	replay_destroy();
+	queue_destroy(event_lanes);
+	record_pool_destroy();
+	intern_destroy();
+	filter_destroy();
+	stats_destroy();
+	free(stats_socket);
+	free(stats_listen);
+	free(spool_dir);
 	return rc;
 }
@@ -0,0 +1,59 @@
+# Generate record_layouts.h from record_layouts.txt: the field names of
+# each layout, the layouts and record_layout_find(), which maps a record
+# type to its layout with a switch the compiler can turn into a jump
+# table. Types the audit headers do not define are left out.
+
+BEGIN {
+	FS = "[ \t]+"
+	n = 0
+	print "/* Generated from record_layouts.txt by record_layouts.awk; do not edit. */"
+	print ""
+}
+
+/^#/ || NF == 0 {
+	next
+}
+
+{
+	printf "static const char *const record_layout_%d[] = {\n", n
+	line = "\t"
+	for (i = 2; i <= NF; i++) {
+		field = "\"" $i "\","
+		if (length(line) + length(field) > 72) {
+			print line
+			line = "\t"
+		}
+		line = line (line == "\t" ? "" : " ") field
+	}
+	print line
+	print "};"
+	print ""
+	types[n] = $1
+	counts[n] = NF - 1
+	n++
+}
+
+END {
+	print "static const struct record_layout record_layouts[] = {"
+	for (i = 0; i < n; i++) {
+		printf "\t{ record_layout_%d, %d },\n", i, counts[i]
+	}
+	print "};"
+	print ""
+	print "static const struct record_layout *record_layout_find(int type)"
+	print "{"
+	print "\tswitch (type) {"
+	for (i = 0; i < n; i++) {
+		count = split(types[i], names, ",")
+		for (j = 1; j <= count; j++) {
+			printf "#ifdef AUDIT_%s\n", names[j]
+			printf "\tcase AUDIT_%s:\n", names[j]
+			printf "\t\treturn &record_layouts[%d];\n", i
+			print "#endif"
+		}
+	}
+	print "\tdefault:"
+	print "\t\treturn NULL;"
+	print "\t}"
+	print "}"
+}